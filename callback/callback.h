@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace mushanyu {
+/***
+ * @description: 只能移动的 void(Args...) 可调用对象, 替代 std::function<void(Args...)>
+ * 不超过 kInlineSize 字节且移动不抛异常的可调用对象直接存在对象内部, 不做堆分配;
+ * 更大的才放到堆上. 空指针和空的 std::function 构造出来的 BasicCallback 也为空.
+ */
+template <class... Args>
+class BasicCallback {
+public:
+    static const size_t kInlineSize = 48;
+
+    BasicCallback() noexcept = default;
+    BasicCallback(std::nullptr_t) noexcept {}
+
+    template <class F, class D = typename std::decay<F>::type,
+              class = typename std::enable_if<!std::is_same<D, BasicCallback>::value && std::is_invocable_r<void, D&, Args...>::value>::type>
+    BasicCallback(F&& f) {
+        if (IsNull(f)) {
+            return;
+        }
+        if constexpr (sizeof(D) <= kInlineSize && alignof(D) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<D>::value) {
+            new (storage_) D(std::forward<F>(f));
+            ops_ = &InlineOps<D>::ops;
+        } else {
+            *(D**)storage_ = new D(std::forward<F>(f));
+            ops_ = &HeapOps<D>::ops;
+        }
+    }
+
+    BasicCallback(BasicCallback&& other) noexcept {
+        moveFrom(other);
+    }
+
+    BasicCallback& operator=(BasicCallback&& other) noexcept {
+        if (this != &other) {
+            clear();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    BasicCallback& operator=(std::nullptr_t) noexcept {
+        clear();
+        return *this;
+    }
+
+    BasicCallback(const BasicCallback&) = delete;
+    BasicCallback& operator=(const BasicCallback&) = delete;
+
+    ~BasicCallback() {
+        clear();
+    }
+
+    void operator()(Args... args) {
+        ops_->invoke(storage_, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept {
+        return ops_ != nullptr;
+    }
+
+    void swap(BasicCallback& other) noexcept {
+        BasicCallback tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    friend bool operator==(const BasicCallback& cb, std::nullptr_t) noexcept {return !cb;}
+    friend bool operator!=(const BasicCallback& cb, std::nullptr_t) noexcept {return !!cb;}
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage, Args... args);
+        // 把 src 里的对象移动到 dst 并销毁 src 里的对象
+        void (*relocate)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    template <class D>
+    struct InlineOps {
+        static void Invoke(void* storage, Args... args) {
+            (*(D*)storage)(std::forward<Args>(args)...);
+        }
+        static void Relocate(void* dst, void* src) {
+            new (dst) D(std::move(*(D*)src));
+            ((D*)src)->~D();
+        }
+        static void Destroy(void* storage) {
+            ((D*)storage)->~D();
+        }
+        static constexpr Ops ops = {&Invoke, &Relocate, &Destroy};
+    };
+
+    template <class D>
+    struct HeapOps {
+        static void Invoke(void* storage, Args... args) {
+            (**(D**)storage)(std::forward<Args>(args)...);
+        }
+        static void Relocate(void* dst, void* src) {
+            *(D**)dst = *(D**)src;
+        }
+        static void Destroy(void* storage) {
+            delete *(D**)storage;
+        }
+        static constexpr Ops ops = {&Invoke, &Relocate, &Destroy};
+    };
+
+    template <class D>
+    static bool IsNull(const D& f) {
+        if constexpr (std::is_pointer<D>::value || std::is_member_pointer<D>::value) {
+            return f == nullptr;
+        } else {
+            return false;
+        }
+    }
+
+    template <class R, class... FArgs>
+    static bool IsNull(const std::function<R(FArgs...)>& f) {
+        return !f;
+    }
+
+    void moveFrom(BasicCallback& other) noexcept {
+        if (other.ops_) {
+            other.ops_->relocate(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    void clear() noexcept {
+        if (ops_) {
+            const Ops* ops = ops_;
+            ops_ = nullptr;
+            ops->destroy(storage_);
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+    const Ops* ops_ = nullptr;
+};
+
+using Callback = BasicCallback<>;
+}
@@ -0,0 +1,109 @@
+// 断言里有要执行的调用, 总是打开
+#undef NDEBUG
+#include "callback.h"
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <cassert>
+
+using namespace mushanyu;
+
+std::vector<int> order;
+
+void func(int i) {
+    order.push_back(i);
+}
+
+// 被构造或移动时记下自己的地址, 用来判断可调用对象存在 Callback 内部还是堆上
+struct Probe {
+    static const void* where;
+    Probe() {where = this;}
+    Probe(const Probe&) {where = this;}
+    Probe(Probe&&) noexcept {where = this;}
+};
+const void* Probe::where = nullptr;
+
+static bool storedInside(const Callback& cb) {
+    const char* begin = (const char*)&cb;
+    const char* p = (const char*)Probe::where;
+    return p >= begin && p < begin + sizeof(Callback);
+}
+
+int main() {
+    std::vector<Callback> cbs;
+    order.reserve(16);
+
+    // 小的 lambda 存在 Callback 内部
+    std::shared_ptr<int> count = std::make_shared<int>(0);
+    for (int i = 0; i < 5; i ++) {
+        cbs.emplace_back([count, i]() {
+            *count += i;
+            order.push_back(i);
+        });
+    }
+    assert(count.use_count() == 6);
+
+    Probe probe;
+    Callback small([probe]() {});
+    assert(storedInside(small));
+    // 移动时跟着搬到新的 Callback 里
+    Callback moved = std::move(small);
+    assert(!small && moved && storedInside(moved));
+
+    // 超过内联大小的放到堆上, 移动只换指针
+    char big[128] = {0};
+    Callback large([probe, big]() {(void)big;});
+    assert(large && !storedInside(large));
+    const void* heap = Probe::where;
+    Callback large_moved = std::move(large);
+    assert(!large && Probe::where == heap);
+
+    // 只能移动的捕获
+    std::unique_ptr<int> value(new int(42));
+    cbs.emplace_back([value = std::move(value)]() {
+        order.push_back(*value);
+    });
+
+    char buffer[128] = "large capture";
+    buffer[127] = 100;
+    cbs.emplace_back([buffer]() {
+        order.push_back(buffer[127]);
+    });
+
+    cbs.emplace_back(std::bind(&func, 7));
+
+    // 空的 std::function 和函数指针得到空的 Callback
+    assert(!Callback(std::function<void()>()));
+    assert(!Callback((void (*)()) nullptr));
+    assert(Callback(std::function<void()>([]() {})));
+
+    for (auto& cb : cbs) {
+        Callback tmp = std::move(cb);
+        assert(!cb && tmp);
+        tmp();
+    }
+
+    std::vector<int> expected = {0, 1, 2, 3, 4, 42, 100, 7};
+    assert(order == expected);
+    assert(*count == 10);
+    // 调用完的 tmp 已经析构, 捕获的 shared_ptr 随之释放
+    assert(count.use_count() == 1);
+
+    cbs.clear();
+
+    // 带参数的版本, 例如接受连接的回调
+    std::unique_ptr<int> base(new int(10));
+    BasicCallback<int> add([base = std::move(base)](int fd) {
+        order.push_back(*base + fd);
+    });
+    BasicCallback<int> add_moved = std::move(add);
+    assert(!add && add_moved);
+    order.clear();
+    add_moved(3);
+    add_moved(4);
+    assert(order == std::vector<int>({13, 14}));
+    assert(!BasicCallback<int>(std::function<void(int)>()));
+
+    std::cout << "callback ok" << std::endl;
+    return 0;
+}
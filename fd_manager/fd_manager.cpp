@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <thread>
 
 namespace mushanyu{
 
@@ -12,36 +13,30 @@ template class Singleton<FdManager>;
 
 // Static variables need to be defined outside the class
 template<typename T>
-T* Singleton<T>::instance = nullptr;
+std::atomic<T*> Singleton<T>::instance{nullptr};
 
 template<typename T>
 std::mutex Singleton<T>::mutex;	
 
-FdCtx::FdCtx(int fd):
-m_fd(fd) {
-	init();
-}
-
 FdCtx::~FdCtx() {
 }
 
 bool FdCtx::init() {
-	if(m_isInit) {
+	if(isInit()) {
 		return true;
 	}
 	
 	struct stat statbuf;
+	bool is_init = false;
+	bool is_socket = false;
 	// fd is in valid
-	if(-1==fstat(m_fd, &statbuf)) {
-		m_isInit = false;
-		m_isSocket = false;
-	} else {
-		m_isInit = true;	
-		m_isSocket = S_ISSOCK(statbuf.st_mode);	
+	if(-1!=fstat(m_fd, &statbuf)) {
+		is_init = true;	
+		is_socket = S_ISSOCK(statbuf.st_mode);	
 	}
 
 	// if it is a socket -> set to nonblock
-	if(m_isSocket) {
+	if(is_socket) {
 		// fcntl_f() -> the original fcntl() -> get the socket info
 		int flags = fcntl_f(m_fd, F_GETFL, 0);
 		if(!(flags & O_NONBLOCK))
@@ -49,67 +44,79 @@ bool FdCtx::init() {
 			// if not -> set to nonblock
 			fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
 		}
-		m_sysNonblock = true;
-	} else {
-		m_sysNonblock = false;
 	}
+	m_sysNonblock.store(is_socket, std::memory_order_relaxed);
+	m_isSocket.store(is_socket, std::memory_order_relaxed);
+	m_isInit.store(is_init, std::memory_order_relaxed);
 
-	return m_isInit;
+	return is_init;
 }
 
 void FdCtx::setTimeout(int type, uint64_t v) {
 	if(type==SO_RCVTIMEO) {
-		m_recvTimeout = v;
+		m_recvTimeout.store(v, std::memory_order_relaxed);
 	} else {
-		m_sendTimeout = v;
+		m_sendTimeout.store(v, std::memory_order_relaxed);
 	}
 }
 
+void FdCtx::reset() {
+	m_isInit.store(false, std::memory_order_relaxed);
+	m_isSocket.store(false, std::memory_order_relaxed);
+	m_sysNonblock.store(false, std::memory_order_relaxed);
+	m_userNonblock.store(false, std::memory_order_relaxed);
+	m_recvTimeout.store((uint64_t)-1, std::memory_order_relaxed);
+	m_sendTimeout.store((uint64_t)-1, std::memory_order_relaxed);
+	m_isClosed.store(false, std::memory_order_relaxed);
+}
+
 uint64_t FdCtx::getTimeout(int type) {
 	if(type==SO_RCVTIMEO) {
-		return m_recvTimeout;
+		return m_recvTimeout.load(std::memory_order_relaxed);
 	}
 	else {
-		return m_sendTimeout;
+		return m_sendTimeout.load(std::memory_order_relaxed);
 	}
 }
 
 FdManager::FdManager() {
-	m_datas.resize(64);
 }
 
-std::shared_ptr<FdCtx> FdManager::get(int fd, bool auto_create) {
-	if(fd==-1) {
+FdCtx* FdManager::get(int fd, bool auto_create) {
+	FdCtx* ctx = auto_create ? m_datas.getOrCreate(fd, [](FdCtx& c, int i) {c.m_fd = i;}) : m_datas.get(fd);
+	if(!ctx) {
 		return nullptr;
 	}
 
-	std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-	if(m_datas.size() <= fd) {
-		if(auto_create==false) {
-			return nullptr;
-		}
-	} else {
-		if(m_datas[fd]||!auto_create) {
-			return m_datas[fd];
-		}
+	int state = ctx->m_state.load(std::memory_order_acquire);
+	if(state == FdCtx::LIVE) {
+		return ctx;
 	}
-
-	read_lock.unlock();
-	std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-
-	if(m_datas.size() <= fd) {
-		m_datas.resize(fd*1.5);
+	if(!auto_create) {
+		return nullptr;
 	}
 
-	m_datas[fd] = std::make_shared<FdCtx>(fd);
-	return m_datas[fd];
+	// only one creator runs init(), the others wait for it
+	if(state == FdCtx::FREE && ctx->m_state.compare_exchange_strong(state, FdCtx::INITIALIZING, std::memory_order_acq_rel)) {
+		ctx->reset();
+		ctx->init();
+		ctx->m_state.store(FdCtx::LIVE, std::memory_order_release);
+		return ctx;
+	}
+	while(ctx->m_state.load(std::memory_order_acquire) == FdCtx::INITIALIZING) {
+		std::this_thread::yield();
+	}
+	return ctx;
 }
 
 void FdManager::del(int fd) {
-	std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-	if(m_datas.size() <= fd) {
+	FdCtx* ctx = m_datas.get(fd);
+	if(!ctx) {
 		return;
 	}
-	m_datas[fd].reset();
+	// a thread still holding ctx sees it closed before the number can be handed out again
+	ctx->m_generation.fetch_add(1, std::memory_order_relaxed);
+	ctx->m_isClosed.store(true, std::memory_order_release);
+	ctx->m_state.store(FdCtx::FREE, std::memory_order_release);
 }
 }
\ No newline at end of file
@@ -1,63 +1,119 @@
 #pragma once
 
 #include <memory>
-#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <sys/socket.h>
 #include "../thread/thread.h"
+#include "../timer/timer.h"
+#include "fd_table.h"
 
 
 namespace mushanyu{
 
-// fd info
-class FdCtx : public std::enable_shared_from_this<FdCtx> {
+// fd info, lives in FdManager's table and is reused when the fd number is reused.
+// Lifetime: a FdCtx* from FdManager::get() stays valid memory for the manager's lifetime, but it
+// describes "whatever fd currently has this number". After del() isClosed() is true and
+// generation() has moved on, until get(fd, true) hands it to the next fd with that number and
+// reset() clears the flags. The fields are atomics so a thread still holding the pointer across
+// close/reuse reads either the old or the new values, never a torn one; callers that must not
+// act on a reused number compare generation() before and after.
+class FdCtx {
+public:
+	enum State {
+		FREE = 0,
+		// FdManager::get(fd, true) is running reset()/init()
+		INITIALIZING,
+		LIVE
+	};
+
 private:
-	bool m_isInit = false;
-	bool m_isSocket = false;
-	bool m_sysNonblock = false;
-	bool m_userNonblock = false;
-	bool m_isClosed = false;
-	int m_fd;
+	std::atomic<bool> m_isInit{false};
+	std::atomic<bool> m_isSocket{false};
+	std::atomic<bool> m_sysNonblock{false};
+	std::atomic<bool> m_userNonblock{false};
+	// set by FdManager::del(), cleared when the number is reused
+	std::atomic<bool> m_isClosed{false};
+	int m_fd = -1;
+	std::atomic<int> m_state{FREE};
+	// bumped by every FdManager::del()
+	std::atomic<uint32_t> m_generation{0};
 
 	// read event timeout
-	uint64_t m_recvTimeout = (uint64_t)-1;
+	std::atomic<uint64_t> m_recvTimeout{(uint64_t)-1};
 	// write event timeout
-	uint64_t m_sendTimeout = (uint64_t)-1;
+	std::atomic<uint64_t> m_sendTimeout{(uint64_t)-1};
+	// io_uring requests on this fd that have not completed yet
+	std::atomic<int> m_ringOps{0};
+
+public:
+	// one per direction, reused by every blocking wait on this fd -> no allocation per wait
+	struct TimedWait {
+		TimerNode timer;
+		// a wait is using timer; a concurrent waiter on the same direction must not touch it
+		std::atomic<bool> busy{false};
+		// bumped for every wait, so a timeout callback from an earlier wait is ignored
+		std::atomic<uint32_t> seq{0};
+		// seq of the wait that timed out
+		std::atomic<uint32_t> timedOutSeq{0};
+	};
+
+private:
+	TimedWait m_readWait;
+	TimedWait m_writeWait;
 
 public:
-	FdCtx(int fd);
+	FdCtx() = default;
 	~FdCtx();
 
 	bool init();
-	bool isInit() const {return m_isInit;}
-	bool isSocket() const {return m_isSocket;}
-	bool isClosed() const {return m_isClosed;}
+	bool isInit() const {return m_isInit.load(std::memory_order_relaxed);}
+	bool isSocket() const {return m_isSocket.load(std::memory_order_relaxed);}
+	bool isClosed() const {return m_isClosed.load(std::memory_order_acquire);}
+	uint32_t generation() const {return m_generation.load(std::memory_order_acquire);}
 
-	void setUserNonblock(bool v) {m_userNonblock = v;}
-	bool getUserNonblock() const {return m_userNonblock;}
+	void setUserNonblock(bool v) {m_userNonblock.store(v, std::memory_order_relaxed);}
+	bool getUserNonblock() const {return m_userNonblock.load(std::memory_order_relaxed);}
 
-	void setSysNonblock(bool v) {m_sysNonblock = v;}
-	bool getSysNonblock() const {return m_sysNonblock;}
+	void setSysNonblock(bool v) {m_sysNonblock.store(v, std::memory_order_relaxed);}
+	bool getSysNonblock() const {return m_sysNonblock.load(std::memory_order_relaxed);}
 
 	void setTimeout(int type, uint64_t v);
 	uint64_t getTimeout(int type);
+
+	TimedWait& getTimedWait(int type) {return type==SO_RCVTIMEO ? m_readWait : m_writeWait;}
+
+	// close() has to wake requests parked in the ring itself, cancelling epoll events does not reach them
+	void addRingOp() {m_ringOps.fetch_add(1, std::memory_order_relaxed);}
+	void doneRingOp() {m_ringOps.fetch_sub(1, std::memory_order_relaxed);}
+	bool hasRingOps() const {return m_ringOps.load(std::memory_order_relaxed) > 0;}
+
+private:
+	friend class FdManager;
+	// back to the defaults for a new fd with this number; TimedWait::seq and the generation keep counting
+	void reset();
 };
 
 class FdManager {
 public:
 	FdManager();
 
-	std::shared_ptr<FdCtx> get(int fd, bool auto_create = false);
+	// no lock and no refcount: the returned ctx is never freed while the manager lives,
+	// after del() it is only handed out again for the next fd with the same number
+	FdCtx* get(int fd, bool auto_create = false);
+	// marks the ctx closed and bumps its generation before it can be reused
 	void del(int fd);
 
 private:
-	std::shared_mutex m_mutex;
-	std::vector<std::shared_ptr<FdCtx>> m_datas;
+	// FdCtx carries two timer nodes, 256 per page
+	FdTable<FdCtx, 8> m_datas;
 };
 
 
 template<typename T>
 class Singleton {
 private:
-    static T* instance;
+    static std::atomic<T*> instance;
     static std::mutex mutex;
 
 protected:
@@ -69,18 +125,25 @@ public:
     Singleton& operator=(const Singleton&) = delete;
 
     static T* GetInstance() {
+        // only the first call takes the lock
+        T* p = instance.load(std::memory_order_acquire);
+        if (p) {
+            return p;
+        }
         std::lock_guard<std::mutex> lock(mutex); // Ensure thread safety
-        if (instance == nullptr) 
+        p = instance.load(std::memory_order_relaxed);
+        if (p == nullptr) 
         {
-            instance = new T();
+            p = new T();
+            instance.store(p, std::memory_order_release);
         }
-        return instance;
+        return p;
     }
 
+    // not safe while other threads may still call GetInstance()
     static void DestroyInstance() {
         std::lock_guard<std::mutex> lock(mutex);
-        delete instance;
-        instance = nullptr;
+        delete instance.exchange(nullptr);
     }
 };
 
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <sys/resource.h>
+
+namespace mushanyu {
+/***
+ * @description: 以 fd 为下标的两级表
+ * 第一级是按 RLIMIT_NOFILE 一次分配好的页指针数组, 第二级是按需分配的页, 每页 2^PageBits 个槽位.
+ * 页分配后直到表析构都不会移动或释放, 拿到的槽位指针一直有效; 查找只需要两次 load, 不加锁.
+ * 两个线程同时分配同一页时用 CAS 决出一个, 输的一方释放自己的页.
+ * 槽位本身的并发访问由使用者负责.
+ */
+template <class T, size_t PageBits = 10>
+class FdTable {
+public:
+    static constexpr size_t kPageSize = size_t(1) << PageBits;
+
+    FdTable() : FdTable(MaxFds()) {}
+    explicit FdTable(size_t max_fds)
+        : pageCount_((max_fds + kPageSize - 1) / kPageSize), pages_(new std::atomic<T*>[pageCount_]) {
+        for (size_t i = 0; i < pageCount_; ++i) {
+            pages_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~FdTable() {
+        for (size_t i = 0; i < pageCount_; ++i) {
+            delete[] pages_[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    FdTable(const FdTable&) = delete;
+    FdTable& operator=(const FdTable&) = delete;
+
+    // 所在页还没分配或者超出范围时返回 nullptr
+    T* get(int fd) const {
+        if (fd < 0 || (size_t) fd >= capacity()) {
+            return nullptr;
+        }
+        T* page = pages_[fd >> PageBits].load(std::memory_order_acquire);
+        return page ? &page[fd & (kPageSize - 1)] : nullptr;
+    }
+
+    // 所在页不存在时分配, 新页的每个槽位发布前先调用 init(slot, fd); 超出范围返回 nullptr
+    template <class Init>
+    T* getOrCreate(int fd, Init&& init) {
+        if (fd < 0 || (size_t) fd >= capacity()) {
+            return nullptr;
+        }
+        std::atomic<T*>& slot = pages_[fd >> PageBits];
+        T* page = slot.load(std::memory_order_acquire);
+        if (!page) {
+            T* fresh = new T[kPageSize];
+            int base = fd & ~(int) (kPageSize - 1);
+            for (size_t i = 0; i < kPageSize; ++i) {
+                init(fresh[i], base + (int) i);
+            }
+            if (slot.compare_exchange_strong(page, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                page = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        return &page[fd & (kPageSize - 1)];
+    }
+
+    T* getOrCreate(int fd) {
+        return getOrCreate(fd, [](T&, int) {});
+    }
+
+    // 依次访问所有已分配的槽位
+    template <class F>
+    void forEach(F&& f) {
+        for (size_t i = 0; i < pageCount_; ++i) {
+            T* page = pages_[i].load(std::memory_order_acquire);
+            if (page) {
+                for (size_t j = 0; j < kPageSize; ++j) {
+                    f(page[j]);
+                }
+            }
+        }
+    }
+
+    size_t capacity() const {return pageCount_ << PageBits;}
+
+    // 进程能打开的最大 fd 数, 取硬限制(setrlimit 最多能调到这里); 没有限制时按 1M 算
+    static size_t MaxFds() {
+        rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_max == RLIM_INFINITY || rl.rlim_max > kMaxFds) {
+            return kMaxFds;
+        }
+        return rl.rlim_max;
+    }
+
+private:
+    static constexpr size_t kMaxFds = size_t(1) << 20;
+
+    const size_t pageCount_;
+    std::unique_ptr<std::atomic<T*>[]> pages_;
+};
+}
@@ -0,0 +1,161 @@
+#include "context.h"
+
+#include <iostream>
+#include <cstdint>
+#include <pthread.h>
+
+#ifdef MUSHANYU_FIBER_ASM
+
+// void mushanyu_context_swap(void** from_sp, void* to_sp)
+// 把 callee-saved 寄存器压到当前栈上, 保存栈指针到 *from_sp, 再从 to_sp 恢复.
+// 协程之间是协作式切换, 浮点控制字(mxcsr/fpcr)按线程共享, 不做保存.
+extern "C" void mushanyu_context_swap(void** from_sp, void* to_sp);
+// 新上下文第一次被切入时的落脚点, 从寄存器里取出入口函数并调用
+extern "C" void mushanyu_context_entry();
+
+#if defined(__x86_64__)
+asm(R"(
+    .text
+    .globl mushanyu_context_swap
+    .hidden mushanyu_context_swap
+    .type mushanyu_context_swap, @function
+    .p2align 4
+mushanyu_context_swap:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size mushanyu_context_swap, .-mushanyu_context_swap
+
+    .globl mushanyu_context_entry
+    .hidden mushanyu_context_entry
+    .type mushanyu_context_entry, @function
+    .p2align 4
+mushanyu_context_entry:
+    callq *%rbx
+    ud2
+    .size mushanyu_context_entry, .-mushanyu_context_entry
+)");
+#elif defined(__aarch64__)
+asm(R"(
+    .text
+    .globl mushanyu_context_swap
+    .hidden mushanyu_context_swap
+    .type mushanyu_context_swap, %function
+    .p2align 4
+mushanyu_context_swap:
+    sub sp, sp, #0xa0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xa0
+    ret
+    .size mushanyu_context_swap, .-mushanyu_context_swap
+
+    .globl mushanyu_context_entry
+    .hidden mushanyu_context_entry
+    .type mushanyu_context_entry, %function
+    .p2align 4
+mushanyu_context_entry:
+    blr x19
+    brk #0
+    .size mushanyu_context_entry, .-mushanyu_context_entry
+)");
+#endif
+
+namespace mushanyu {
+    void Context::make(void* stack, size_t size, void (*fn)()) {
+        uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+        // 从低到高: r15 r14 r13 r12 rbx rbp ret, ret 之后 rsp 16 字节对齐
+        void** sp = (void**)(top - 72);
+        for (int i = 0; i < 6; ++i) {
+            sp[i] = nullptr;
+        }
+        sp[4] = (void*)fn;
+        sp[6] = (void*)&mushanyu_context_entry;
+#elif defined(__aarch64__)
+        // d8-d15, x19-x28, x29(fp), x30(lr), 共 0xa0 字节
+        void** sp = (void**)(top - 0xa0);
+        for (int i = 0; i < 20; ++i) {
+            sp[i] = nullptr;
+        }
+        sp[8] = (void*)fn;
+        sp[19] = (void*)&mushanyu_context_entry;
+#endif
+        sp_ = sp;
+    }
+
+    void* Context::getSp() const {
+        return sp_;
+    }
+
+    void Context::Swap(Context* from, Context* to) {
+        mushanyu_context_swap(&from->sp_, to->sp_);
+    }
+}
+
+#else
+
+namespace mushanyu {
+    void Context::make(void* stack, size_t size, void (*fn)()) {
+        if (getcontext(&uc_)) {
+            std::cerr << "Context::make() getcontext failed" << std::endl;
+            pthread_exit(NULL);
+        }
+        uc_.uc_link = nullptr;
+        uc_.uc_stack.ss_sp = stack;
+        uc_.uc_stack.ss_size = size;
+        makecontext(&uc_, fn, 0);
+    }
+
+    void* Context::getSp() const {
+#if defined(__x86_64__)
+        return (void*)uc_.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+        return (void*)uc_.uc_mcontext.sp;
+#else
+        return nullptr;
+#endif
+    }
+
+    void Context::Swap(Context* from, Context* to) {
+        if (swapcontext(&from->uc_, &to->uc_)) {
+            std::cerr << "Context::Swap() swapcontext failed" << std::endl;
+            pthread_exit(NULL);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+// 上下文切换后端, 编译期选择:
+// x86-64 / aarch64 默认使用手写汇编, 只保存 callee-saved 寄存器和栈指针, 不做 sigprocmask 系统调用;
+// 其它平台或定义了 MUSHANYU_FIBER_UCONTEXT 时回退到 ucontext.
+#if !defined(MUSHANYU_FIBER_UCONTEXT) && (defined(__x86_64__) || defined(__aarch64__))
+#define MUSHANYU_FIBER_ASM 1
+#else
+#include <ucontext.h>
+#endif
+
+// 能拿到切出时的栈指针, 才支持共享栈(拷贝栈)协程
+#if defined(MUSHANYU_FIBER_ASM) || defined(__x86_64__) || defined(__aarch64__)
+#define MUSHANYU_FIBER_COPY_STACK 1
+#endif
+
+namespace mushanyu {
+class Context {
+public:
+    // 在 [stack, stack + size) 上构造一个入口为 fn 的上下文, fn 不允许返回
+    void make(void* stack, size_t size, void (*fn)());
+
+    // 切出后保存下来的栈指针, 不支持时返回 nullptr
+    void* getSp() const;
+
+    // 保存当前上下文到 from, 切换到 to
+    static void Swap(Context* from, Context* to);
+
+private:
+#ifdef MUSHANYU_FIBER_ASM
+    void* sp_ = nullptr;
+#else
+    ucontext_t uc_;
+#endif
+};
+}
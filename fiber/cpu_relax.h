@@ -0,0 +1,12 @@
+#pragma once
+
+namespace mushanyu {
+    // 自旋等待时提示 CPU 当前在忙等, 降低功耗并让出超线程的执行资源
+    inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield" ::: "memory");
+#endif
+    }
+}
@@ -1,6 +1,11 @@
 #include "fiber.h"
+#include "stack_pool.h"
+#include "cpu_relax.h"
 
-static bool debug = false;
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <sys/syscall.h>
 
 namespace mushanyu {
     // 正在运行的协程
@@ -13,6 +18,22 @@ namespace mushanyu {
     static std::atomic<uint64_t> s_fiber_count{0};
     // 协程id
     static std::atomic<uint64_t> s_fiber_id{0};
+    // 共享栈大小
+    static size_t s_shared_stack_size = 1 << 20;
+
+    struct Fiber::SharedStack {
+        void* stack = nullptr;
+        size_t size = 0;
+        // 当前栈上的内容属于哪个协程
+        Fiber* occupant = nullptr;
+
+        ~SharedStack() {
+            if (stack) {
+                StackPool::Dealloc(stack, size);
+            }
+        }
+    };
+    static thread_local int t_tid = -1;
 
     void Fiber::SetThis(Fiber* f) {
         t_fiber = f;
@@ -34,6 +55,10 @@ namespace mushanyu {
         t_scheduler_fiber = f;
     }
 
+    void Fiber::SetSharedStackSize(size_t size) {
+        s_shared_stack_size = size;
+    }
+
     uint64_t Fiber::GetFiberId() {
         if (t_fiber) {
             return t_fiber->getId();
@@ -43,33 +68,30 @@ namespace mushanyu {
 
     Fiber::Fiber() {
         SetThis(this);
-        state_ = RUNNING;
+        state_.store(RUNNING, std::memory_order_relaxed);
 
-        if (getcontext(&ctx_)) {
-            std::cerr << "Fiber() failed" << std::endl;
-            pthread_exit(NULL);
-        }
         id_ = s_fiber_id ++;
         s_fiber_count ++;
         if (debug) std::cout << "Fiber(): main id = " << id_ << std::endl;
     }
 
-    Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_schedule) :
-    cb_(cb), runInScheduler_(run_in_schedule) {
-        state_ = READY;
-        
-        stacksize_ = stacksize ? stacksize : 128000;
-        stack_ = malloc(stacksize_);
+    Fiber::Fiber(Callback cb, size_t stacksize, bool run_in_schedule, bool shared_stack) :
+    cb_(std::move(cb)), runInScheduler_(run_in_schedule) {
+        state_.store(READY, std::memory_order_relaxed);
 
-        if (getcontext(&ctx_)) {
-            std::cerr << "Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler) failed" << std::endl;
-		    pthread_exit(NULL);
-        }
+#ifdef MUSHANYU_FIBER_COPY_STACK
+        useSharedStack_ = shared_stack;
+#endif
+        if (useSharedStack_) {
+            // 栈在第一次 resume 时才确定
+            needMake_ = true;
+        } else {
+            size_t size = stacksize ? stacksize : StackPool::DefaultSize();
+            stack_ = StackPool::Alloc(size);
+            stacksize_ = size;
 
-        ctx_.uc_link = nullptr;
-        ctx_.uc_stack.ss_sp = stack_;
-        ctx_.uc_stack.ss_size = stacksize_;
-        makecontext(&ctx_, &Fiber::MainFunc, 0);
+            ctx_.make(stack_, stacksize_, &Fiber::MainFunc);
+        }
 
         id_ = s_fiber_id ++;
         s_fiber_count ++;
@@ -78,63 +100,129 @@ namespace mushanyu {
 
     Fiber::~Fiber() {
         s_fiber_count --;
-        if (stack_) {
-            free(stack_);
+        if (useSharedStack_) {
+            if (sharedStack_ && sharedStack_->occupant == this) {
+                sharedStack_->occupant = nullptr;
+            }
+            free(saveBuf_);
+        } else if (stack_) {
+            StackPool::Dealloc(stack_, stacksize_);
         }
         if (debug) std::cout << "~!Fiber(): main id = " << id_ << std::endl;
     }
 
-    void Fiber::reset(std::function<void()> cb) {
-        assert(stack_ != nullptr && state_ == TERM);
-        state_ = READY;
-        cb_ = cb;
+    void Fiber::reset(Callback cb) {
+        assert((stack_ != nullptr || useSharedStack_) && getState() == TERM);
+        state_.store(READY, std::memory_order_relaxed);
+        cb_.swap(cb);
 
-        if (getcontext(&ctx_)) {
-            std::cerr << "reset() failed" << std::endl;
-            pthread_exit(NULL);
+        if (useSharedStack_) {
+            needMake_ = true;
+            saveSize_ = 0;
+        } else {
+            ctx_.make(stack_, stacksize_, &Fiber::MainFunc);
+        }
+    }
+
+    void Fiber::switchInSharedStack() {
+        if (t_tid == -1) {
+            t_tid = syscall(SYS_gettid);
         }
+        // 本线程的共享栈
+        static thread_local SharedStack t_shared_stack;
+        SharedStack& ss = t_shared_stack;
+        if (boundThread_ == -1) {
+            if (!ss.stack) {
+                ss.size = s_shared_stack_size;
+                ss.stack = StackPool::Alloc(ss.size);
+            }
+            boundThread_ = t_tid;
+            sharedStack_ = &ss;
+            stack_ = ss.stack;
+            stacksize_ = ss.size;
+        }
+        assert(boundThread_ == t_tid);
+        // 拷贝期间不能运行在共享栈上
+        assert(!t_fiber || !t_fiber->useSharedStack_);
 
-        ctx_.uc_link = nullptr;
-        ctx_.uc_stack.ss_sp = stack_;
-        ctx_.uc_stack.ss_size = stacksize_;
-        makecontext(&ctx_, &Fiber::MainFunc, 0);
+        if (ss.occupant == this) {
+            return;
+        }
+        if (ss.occupant) {
+            ss.occupant->saveSharedStack();
+        }
+        ss.occupant = this;
+        if (needMake_) {
+            needMake_ = false;
+            ctx_.make(stack_, stacksize_, &Fiber::MainFunc);
+        } else if (saveSize_) {
+            memcpy((char*)stack_ + stacksize_ - saveSize_, saveBuf_, saveSize_);
+        }
+    }
+
+    void Fiber::saveSharedStack() {
+        if (getState() == TERM) {
+            return;
+        }
+        char* sp = (char*)ctx_.getSp();
+        saveSize_ = (char*)stack_ + stacksize_ - sp;
+        if (saveSize_ > saveCap_) {
+            saveCap_ = saveSize_ * 2;
+            free(saveBuf_);
+            saveBuf_ = (char*)malloc(saveCap_);
+        }
+        memcpy(saveBuf_, sp, saveSize_);
     }
 
     void Fiber::resume() {
-        assert(state_ == READY);
-        state_ = RUNNING;
+        // 协程可能已经被放进调度队列, 但在原来的线程上还没有切出,
+        // 例如 do_io 中 addEvent 之后、yield 之前事件就已经触发, 此时等它切出完成
+        State expected = READY;
+        for (int spins = 0; !state_.compare_exchange_weak(expected, RUNNING, std::memory_order_acquire, std::memory_order_relaxed); ++ spins) {
+            // 已经结束的协程永远不会回到 READY, 调用方的错误, 不能在这里一直等, 也不能当作成功返回
+            if (expected == TERM) {
+                assert(!"Fiber::resume() on terminated fiber");
+                abort();
+            }
+            expected = READY;
+            if (spins < 64) {
+                CpuRelax();
+            } else {
+                sched_yield();
+            }
+        }
+
+        if (useSharedStack_) {
+            switchInSharedStack();
+        }
         if (runInScheduler_) {
             SetThis(this);
-            if (swapcontext(&(t_scheduler_fiber->ctx_), &ctx_)) {
-                std::cerr << "resume() to t_scheduler_fiber failed" << std::endl;
-                pthread_exit(NULL);
-            }
+            Context::Swap(&(t_scheduler_fiber->ctx_), &ctx_);
         } else {
             SetThis(this);
-            if (swapcontext(&(t_thread_fiber->ctx_), &ctx_)) {
-                std::cerr << "resume() to t_thread_fiber failed" << std::endl;
-                pthread_exit(NULL);
-            }
+            Context::Swap(&(t_thread_fiber->ctx_), &ctx_);
         }
+
+        // 已经完全切出, 允许其它线程再次 resume
+        expected = SUSPENDING;
+        state_.compare_exchange_strong(expected, READY, std::memory_order_release, std::memory_order_relaxed);
     }
 
     void Fiber::yield() {
-        assert(state_ == RUNNING || state_ == TERM);
-        if (state_ != TERM) {
-            state_ = READY;
-        } 
+        State state = getState();
+        assert(state == RUNNING || state == TERM);
+        if (state != TERM) {
+            state_.store(SUSPENDING, std::memory_order_relaxed);
+        } else if (useSharedStack_ && sharedStack_->occupant == this) {
+            // 已经结束, 栈上的内容不需要保留
+            sharedStack_->occupant = nullptr;
+        }
         if (runInScheduler_) {
             SetThis(t_scheduler_fiber);
-            if (swapcontext(&ctx_, &(t_thread_fiber->ctx_))) {
-                std::cerr << "yield() to t_thread_fiber failed" << std::endl;
-                pthread_exit(NULL);
-            }
+            Context::Swap(&ctx_, &(t_scheduler_fiber->ctx_));
         } else {
             SetThis(t_thread_fiber.get());
-            if (swapcontext(&ctx_, &(t_thread_fiber->ctx_))) {
-                std::cerr << "resume() to t_thread_fiber failed" << std::endl;
-                pthread_exit(NULL);
-            }
+            Context::Swap(&ctx_, &(t_thread_fiber->ctx_));
         }
     }
 
@@ -144,7 +232,7 @@ namespace mushanyu {
 
         curr->cb_();
         curr->cb_ = nullptr;
-        curr->state_ = TERM;
+        curr->state_.store(TERM, std::memory_order_release);
     
         auto raw_ptr = curr.get();
         curr.reset();
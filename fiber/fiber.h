@@ -5,49 +5,77 @@
 #include <atomic>
 #include <functional>
 #include <cassert>
-#include <ucontext.h>
 #include <unistd.h>
 #include <mutex>
 
+#include "context.h"
+#include "../callback/callback.h"
+
 static bool debug = false;
 
 namespace mushanyu {
 class Fiber : public std::enable_shared_from_this<Fiber> {
 public:
     // 协程状态
+    // READY -> RUNNING: resume() 用 CAS 抢占, 同一个协程不会在两个线程上同时运行
+    // RUNNING -> SUSPENDING: yield() 开始切出
+    // SUSPENDING -> READY: 切出完成后由 resume() 的调用方设置, 此后才能再次被 resume()
     enum State{
         READY,
         RUNNING,
+        SUSPENDING,
         TERM
     };
     
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_schedule = true);
+    // shared_stack 为 true 时使用共享栈: 同一线程上的共享栈协程轮流在一块大栈上运行,
+    // 切走时把用到的那段栈拷出, 切回时再拷回. 第一次 resume 后绑定到该线程, 之后只能在该线程上运行;
+    // 栈上变量的地址在切走期间无效, 不要交给其它协程使用.
+    Fiber(Callback cb, size_t stacksize = 0, bool run_in_schedule = true, bool shared_stack = false);
     ~Fiber();
     
-    void reset(std::function<void()> cb);
+    void reset(Callback cb);
+    // 不能对已经结束的协程调用, 否则进程直接终止
     void resume();
     void yield();
 
     uint64_t getId() const {return id_;}
-    State getState() const {return state_;};
+    State getState() const {return state_.load(std::memory_order_acquire);};
+    // 共享栈协程绑定的线程, 未绑定时为 -1
+    int getBoundThread() const {return boundThread_;}
+    bool isSharedStack() const {return useSharedStack_;}
 
     static void SetThis(Fiber* f);
     static std::shared_ptr<Fiber> GetThis();
     static void SetSchedulerFiber(Fiber *f);
     static uint64_t GetFiberId();
     static void MainFunc();
+    // 每个线程共享栈的大小, 需在线程第一次运行共享栈协程前设置
+    static void SetSharedStackSize(size_t size);
 
-    std::mutex mtx_;
 private:
+    struct SharedStack;
+
     Fiber();
 
+    void switchInSharedStack();
+    void saveSharedStack();
+
     uint64_t id_ = 0;
     uint32_t stacksize_ = 0;
-    State state_ = READY;
-    ucontext_t ctx_;
+    std::atomic<State> state_{READY};
+    Context ctx_;
     void* stack_ = nullptr;
-    std::function<void()> cb_;
+    Callback cb_;
     bool runInScheduler_;
+
+    SharedStack* sharedStack_ = nullptr;
+    bool useSharedStack_ = false;
+    bool needMake_ = false;
+    int boundThread_ = -1;
+    // 切走时保存的栈内容
+    char* saveBuf_ = nullptr;
+    size_t saveSize_ = 0;
+    size_t saveCap_ = 0;
 };
 
 
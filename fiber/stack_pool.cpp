@@ -0,0 +1,196 @@
+#include "stack_pool.h"
+
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mushanyu {
+    static const size_t kMinShift = 15;
+    static const size_t kMaxShift = 20;
+    static const size_t kClassCount = kMaxShift - kMinShift + 1;
+    // 每个线程每个级别最多缓存的栈数
+    static const size_t kThreadCacheLimit = 32;
+    // 全局池每个级别最多缓存的栈数
+    static const size_t kGlobalCacheLimit = 512;
+
+    static const size_t kHugePageSize = 2 << 20;
+
+    static StackPool::Mode s_mode = StackPool::MALLOC;
+    static int s_flags = 0;
+    static std::atomic<bool> s_used{false};
+
+    bool StackPool::SetMode(Mode mode, int flags) {
+        if (s_used) {
+            return false;
+        }
+        s_mode = mode;
+        s_flags = flags;
+        return true;
+    }
+
+    StackPool::Mode StackPool::GetMode() {
+        return s_mode;
+    }
+
+    size_t StackPool::DefaultSize() {
+        return s_mode == MMAP ? (1 << 20) : 128000;
+    }
+
+    static bool UseHugetlb(size_t size) {
+        return (s_flags & StackPool::HUGETLB) && size % kHugePageSize == 0;
+    }
+
+    static size_t GuardSize(size_t size) {
+        if (!(s_flags & StackPool::GUARD_PAGE) || UseHugetlb(size)) {
+            return 0;
+        }
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        return page;
+    }
+
+    static void* RawAlloc(size_t size) {
+        s_used = true;
+        if (s_mode == StackPool::MALLOC) {
+            void* stack = malloc(size);
+            if (!stack) {
+                throw std::bad_alloc();
+            }
+            return stack;
+        }
+
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK;
+        void* base = MAP_FAILED;
+        if (UseHugetlb(size)) {
+            // 大页不带 MAP_NORESERVE: 预留不到时 mmap 直接失败回退, 否则要等到缺页才 SIGBUS
+            base = mmap(nullptr, size, PROT_READ | PROT_WRITE, (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+            if (base != MAP_FAILED) {
+                return base;
+            }
+        }
+
+        size_t guard = GuardSize(size);
+        base = mmap(nullptr, size + guard, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (base == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        if (guard && mprotect(base, guard, PROT_NONE)) {
+            munmap(base, size + guard);
+            throw std::bad_alloc();
+        }
+        char* stack = (char*)base + guard;
+        if (s_flags & StackPool::TRANSPARENT_HUGEPAGE) {
+            madvise(stack, size, MADV_HUGEPAGE);
+        }
+        return stack;
+    }
+
+    static void RawFree(void* stack, size_t size) {
+        if (s_mode == StackPool::MALLOC) {
+            free(stack);
+            return;
+        }
+        // HUGETLB 尺寸的栈不论是否回退到普通页都不带保护页, 和 RawAlloc 保持一致
+        size_t guard = GuardSize(size);
+        munmap((char*)stack - guard, size + guard);
+    }
+
+    static int SizeClass(size_t size) {
+        size_t shift = kMinShift;
+        while (((size_t)1 << shift) < size) {
+            ++ shift;
+        }
+        return shift > kMaxShift ? -1 : (int)(shift - kMinShift);
+    }
+
+    struct GlobalPool {
+        std::mutex mutex;
+        std::vector<void*> stacks[kClassCount];
+    };
+
+    static GlobalPool& GetGlobalPool() {
+        // 不析构, 线程缓存在进程退出阶段仍可能把栈还回来
+        static GlobalPool* pool = new GlobalPool;
+        return *pool;
+    }
+
+    static void ReleaseToGlobal(int cls, std::vector<void*>& stacks, size_t keep) {
+        GlobalPool& pool = GetGlobalPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        std::vector<void*>& global = pool.stacks[cls];
+        while (stacks.size() > keep) {
+            void* stack = stacks.back();
+            stacks.pop_back();
+            if (global.size() < kGlobalCacheLimit) {
+                global.push_back(stack);
+            } else {
+                RawFree(stack, (size_t)1 << (cls + kMinShift));
+            }
+        }
+    }
+
+    static thread_local bool t_cache_destroyed = false;
+
+    struct ThreadCache {
+        std::vector<void*> stacks[kClassCount];
+
+        ~ThreadCache() {
+            for (size_t i = 0; i < kClassCount; ++i) {
+                ReleaseToGlobal(i, stacks[i], 0);
+            }
+            t_cache_destroyed = true;
+        }
+    };
+
+    static thread_local ThreadCache t_cache;
+
+    void* StackPool::Alloc(size_t& size) {
+        int cls = SizeClass(size);
+        if (cls < 0) {
+            return RawAlloc(size);
+        }
+        size = (size_t)1 << (cls + kMinShift);
+        if (t_cache_destroyed) {
+            return RawAlloc(size);
+        }
+
+        std::vector<void*>& local = t_cache.stacks[cls];
+        if (local.empty()) {
+            GlobalPool& pool = GetGlobalPool();
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            std::vector<void*>& global = pool.stacks[cls];
+            while (!global.empty() && local.size() < kThreadCacheLimit / 2) {
+                local.push_back(global.back());
+                global.pop_back();
+            }
+        }
+        if (local.empty()) {
+            return RawAlloc(size);
+        }
+        void* stack = local.back();
+        local.pop_back();
+        return stack;
+    }
+
+    void StackPool::Dealloc(void* stack, size_t size) {
+        int cls = SizeClass(size);
+        if (cls < 0) {
+            RawFree(stack, size);
+            return;
+        }
+        if (t_cache_destroyed) {
+            std::vector<void*> stacks{stack};
+            ReleaseToGlobal(cls, stacks, 0);
+            return;
+        }
+
+        std::vector<void*>& local = t_cache.stacks[cls];
+        if (local.size() >= kThreadCacheLimit) {
+            ReleaseToGlobal(cls, local, kThreadCacheLimit / 2);
+        }
+        local.push_back(stack);
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+
+namespace mushanyu {
+/***
+ * @description: 协程栈缓存
+ * 栈按 2 的幂分级(32K ~ 1M), 每个线程先从自己的缓存取, 不够再从全局池批量搬运,
+ * 线程缓存满了把一半还给全局池, 全局池也满了才真正释放. 超过最大级别的栈不缓存.
+ */
+class StackPool {
+public:
+    enum Mode {
+        // malloc 分配, 没有溢出保护
+        MALLOC,
+        // mmap 保留虚拟地址, 只有真正用到的页才占用物理内存
+        MMAP
+    };
+
+    // MMAP 模式下的选项
+    enum Flag {
+        // 栈底放一个 PROT_NONE 的保护页, 栈溢出直接触发 SIGSEGV
+        GUARD_PAGE = 0x1,
+        // 对栈区域 madvise(MADV_HUGEPAGE)
+        TRANSPARENT_HUGEPAGE = 0x2,
+        // 大小是 2M 整数倍的栈尝试 MAP_HUGETLB, 失败回退普通页, 这类栈不带保护页
+        HUGETLB = 0x4
+    };
+
+    // 只能在分配第一个栈之前调用, 否则返回 false
+    static bool SetMode(Mode mode, int flags = GUARD_PAGE);
+    static Mode GetMode();
+
+    // 未指定大小时的默认栈大小, MMAP 模式下为 1M 虚拟空间
+    static size_t DefaultSize();
+
+    // size 会被向上取整到所属级别
+    static void* Alloc(size_t& size);
+    static void Dealloc(void* stack, size_t size);
+};
+}
@@ -1,5 +1,14 @@
+// 断言里有要执行的调用, 总是打开
+#undef NDEBUG
 #include "fiber.h"
+#include "stack_pool.h"
 #include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <csignal>
+#include <sys/wait.h>
 
 using namespace mushanyu;
 
@@ -29,7 +38,386 @@ void test_fiber(int i) {
 	std::cout << "hello world " << i << std::endl;
 }
 
+static const int kYields = 3;
+
+#if defined(__x86_64__) || defined(__aarch64__)
+// 把由 pattern 算出的值装进所有 callee-saved 寄存器(aarch64 还有 d8-d15), 调用 fn(arg),
+// 返回之后仍然不对的寄存器个数. fn 里切换协程, 切回来时这些寄存器必须原样恢复
+extern "C" int test_call_with_pattern(uint64_t pattern, void (*fn)(void*), void* arg);
+
+#if defined(__x86_64__)
+asm(R"(
+	.text
+	.globl test_call_with_pattern
+	.type test_call_with_pattern, @function
+	.p2align 4
+test_call_with_pattern:
+	pushq %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	subq $8, %rsp
+	movq %rdi, (%rsp)
+	movq %rdi, %rbx
+	leaq 1(%rdi), %rbp
+	leaq 2(%rdi), %r12
+	leaq 3(%rdi), %r13
+	leaq 4(%rdi), %r14
+	leaq 5(%rdi), %r15
+	movq %rsi, %rax
+	movq %rdx, %rdi
+	callq *%rax
+	movq (%rsp), %rdi
+	xorl %eax, %eax
+	cmpq %rdi, %rbx
+	setne %al
+	xorl %ecx, %ecx
+	leaq 1(%rdi), %rdx
+	cmpq %rdx, %rbp
+	setne %cl
+	addl %ecx, %eax
+	leaq 2(%rdi), %rdx
+	cmpq %rdx, %r12
+	setne %cl
+	addl %ecx, %eax
+	leaq 3(%rdi), %rdx
+	cmpq %rdx, %r13
+	setne %cl
+	addl %ecx, %eax
+	leaq 4(%rdi), %rdx
+	cmpq %rdx, %r14
+	setne %cl
+	addl %ecx, %eax
+	leaq 5(%rdi), %rdx
+	cmpq %rdx, %r15
+	setne %cl
+	addl %ecx, %eax
+	addq $8, %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size test_call_with_pattern, .-test_call_with_pattern
+)");
+#else
+asm(R"(
+	.text
+	.globl test_call_with_pattern
+	.type test_call_with_pattern, %function
+	.p2align 4
+test_call_with_pattern:
+	stp x29, x30, [sp, #-0xb0]!
+	mov x29, sp
+	stp x19, x20, [sp, #0x10]
+	stp x21, x22, [sp, #0x20]
+	stp x23, x24, [sp, #0x30]
+	stp x25, x26, [sp, #0x40]
+	stp x27, x28, [sp, #0x50]
+	stp d8, d9, [sp, #0x60]
+	stp d10, d11, [sp, #0x70]
+	stp d12, d13, [sp, #0x80]
+	stp d14, d15, [sp, #0x90]
+	str x0, [sp, #0xa0]
+	mov x19, x0
+	add x20, x0, #1
+	add x21, x0, #2
+	add x22, x0, #3
+	add x23, x0, #4
+	add x24, x0, #5
+	add x25, x0, #6
+	add x26, x0, #7
+	add x27, x0, #8
+	add x28, x0, #9
+	add x9, x0, #10
+	fmov d8, x9
+	add x9, x0, #11
+	fmov d9, x9
+	add x9, x0, #12
+	fmov d10, x9
+	add x9, x0, #13
+	fmov d11, x9
+	add x9, x0, #14
+	fmov d12, x9
+	add x9, x0, #15
+	fmov d13, x9
+	add x9, x0, #16
+	fmov d14, x9
+	add x9, x0, #17
+	fmov d15, x9
+	mov x9, x1
+	mov x0, x2
+	blr x9
+	ldr x0, [sp, #0xa0]
+	mov x1, #0
+	cmp x19, x0
+	cinc x1, x1, ne
+	add x2, x0, #1
+	cmp x20, x2
+	cinc x1, x1, ne
+	add x2, x0, #2
+	cmp x21, x2
+	cinc x1, x1, ne
+	add x2, x0, #3
+	cmp x22, x2
+	cinc x1, x1, ne
+	add x2, x0, #4
+	cmp x23, x2
+	cinc x1, x1, ne
+	add x2, x0, #5
+	cmp x24, x2
+	cinc x1, x1, ne
+	add x2, x0, #6
+	cmp x25, x2
+	cinc x1, x1, ne
+	add x2, x0, #7
+	cmp x26, x2
+	cinc x1, x1, ne
+	add x2, x0, #8
+	cmp x27, x2
+	cinc x1, x1, ne
+	add x2, x0, #9
+	cmp x28, x2
+	cinc x1, x1, ne
+	fmov x3, d8
+	add x2, x0, #10
+	cmp x3, x2
+	cinc x1, x1, ne
+	fmov x3, d9
+	add x2, x0, #11
+	cmp x3, x2
+	cinc x1, x1, ne
+	fmov x3, d10
+	add x2, x0, #12
+	cmp x3, x2
+	cinc x1, x1, ne
+	fmov x3, d11
+	add x2, x0, #13
+	cmp x3, x2
+	cinc x1, x1, ne
+	fmov x3, d12
+	add x2, x0, #14
+	cmp x3, x2
+	cinc x1, x1, ne
+	fmov x3, d13
+	add x2, x0, #15
+	cmp x3, x2
+	cinc x1, x1, ne
+	fmov x3, d14
+	add x2, x0, #16
+	cmp x3, x2
+	cinc x1, x1, ne
+	fmov x3, d15
+	add x2, x0, #17
+	cmp x3, x2
+	cinc x1, x1, ne
+	mov w0, w1
+	ldp x19, x20, [sp, #0x10]
+	ldp x21, x22, [sp, #0x20]
+	ldp x23, x24, [sp, #0x30]
+	ldp x25, x26, [sp, #0x40]
+	ldp x27, x28, [sp, #0x50]
+	ldp d8, d9, [sp, #0x60]
+	ldp d10, d11, [sp, #0x70]
+	ldp d12, d13, [sp, #0x80]
+	ldp d14, d15, [sp, #0x90]
+	ldp x29, x30, [sp], #0xb0
+	ret
+	.size test_call_with_pattern, .-test_call_with_pattern
+)");
+#endif
+
+static int fiber_mismatch = -1;
+
+static void yieldTimes(void*) {
+	for (int i = 0; i < kYields; i++) {
+		Fiber::GetThis()->yield();
+	}
+}
+
+static void resumeFiber(void* arg) {
+	((Fiber*)arg)->resume();
+}
+
+// 协程和调用方各自在寄存器里放一套值, 来回切换几次之后两边都不能被对方的值覆盖
+static void testCalleeSaved(bool shared_stack) {
+	fiber_mismatch = -1;
+	std::shared_ptr<Fiber> fiber = std::make_shared<Fiber>([]() {
+		fiber_mismatch = test_call_with_pattern(0x5a5a5a5a00000000ull, &yieldTimes, nullptr);
+	}, 0, false, shared_stack);
+	int mismatch = 0;
+	for (int i = 0; i <= kYields; i++) {
+		mismatch += test_call_with_pattern(0x1234567800000000ull + i * 0x100, &resumeFiber, fiber.get());
+	}
+	assert(fiber->getState() == Fiber::TERM);
+	assert(mismatch == 0);
+	assert(fiber_mismatch == 0);
+}
+#endif
+
+// 浮点数跨越切换保持不变, x86-64 上 xmm 都由调用方保存, 这里确认编译器生成的溢出和恢复不受影响
+static void testFloat(bool shared_stack) {
+	volatile double seed = 1.5;
+	double fiber_sum = 0;
+	std::shared_ptr<Fiber> fiber = std::make_shared<Fiber>([&]() {
+		double a = seed, b = seed * 2, c = seed * 3;
+		for (int i = 0; i < kYields; i++) {
+			Fiber::GetThis()->yield();
+			a += 1; b += 2; c += 3;
+		}
+		fiber_sum = a + b + c;
+	}, 0, false, shared_stack);
+	double x = seed * 10, y = seed * 20;
+	for (int i = 0; i <= kYields; i++) {
+		fiber->resume();
+		x += 0.25; y -= 0.25;
+	}
+	assert(fiber_sum == 1.5 * 6 + 6 * kYields);
+	assert(x == 15 + 0.25 * (kYields + 1) && y == 30 - 0.25 * (kYields + 1));
+}
+
+// 入口处的栈要 16 字节对齐, 否则编译器生成的 movaps(例如 printf 保存浮点参数) 会直接崩溃
+static void checkAlignment() {
+	alignas(16) char local[16];
+	// 经过 volatile, 防止编译器按 alignas 把判断折叠掉
+	volatile uintptr_t addr = (uintptr_t)local;
+	assert((addr & 15) == 0);
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.3f", 2.0 / 8);
+	assert(strcmp(buf, "0.250") == 0);
+}
+
+static void testAlignment(size_t stacksize, bool shared_stack) {
+	bool ran = false;
+	std::shared_ptr<Fiber> fiber = std::make_shared<Fiber>([&]() {
+		checkAlignment();
+		ran = true;
+	}, stacksize, false, shared_stack);
+	fiber->resume();
+	assert(ran && fiber->getState() == Fiber::TERM);
+}
+
+// 栈上的数组在切走期间被别的共享栈协程覆盖, 切回来时要从保存的副本拷回
+static void stackWorker(int id, int rounds, std::vector<int>& trace) {
+	int local[256];
+	for (int i = 0; i < 256; i++) {
+		local[i] = id * 1000 + i;
+	}
+	for (int r = 0; r < rounds; r++) {
+		trace.push_back(id);
+		Fiber::GetThis()->yield();
+		for (int i = 0; i < 256; i++) {
+			assert(local[i] == id * 1000 + i + r);
+			local[i]++;
+		}
+	}
+}
+
+// 共享栈和普通协程交替运行, 按 resume 的顺序推进, 每个都看到自己的栈
+static void testSharedStack() {
+	const int kRounds = 5;
+	std::vector<int> trace;
+	std::vector<std::shared_ptr<Fiber>> fibers;
+	// 0, 1, 3 共享一块栈, 2 用自己的栈
+	for (int id = 0; id < 4; id++) {
+		bool shared = id != 2;
+		fibers.push_back(std::make_shared<Fiber>(std::bind(stackWorker, id, kRounds, std::ref(trace)), 0, false, shared));
+		assert(fibers.back()->isSharedStack() == shared);
+	}
+	std::vector<int> expected;
+	for (int r = 0; r <= kRounds; r++) {
+		for (int id = 0; id < 4; id++) {
+			fibers[id]->resume();
+			if (r < kRounds) {
+				expected.push_back(id);
+			}
+		}
+	}
+	assert(trace == expected);
+	for (auto& f : fibers) {
+		assert(f->getState() == Fiber::TERM);
+	}
+	assert(fibers[0]->getBoundThread() != -1 && fibers[2]->getBoundThread() == -1);
+}
+
+// 对已经结束的协程 resume 是调用方的错误, 进程直接终止
+static void testResumeTerminated() {
+	std::shared_ptr<Fiber> fiber = std::make_shared<Fiber>([]() {}, 0, false);
+	fiber->resume();
+	assert(fiber->getState() == Fiber::TERM);
+	pid_t pid = fork();
+	if (pid == 0) {
+		fiber->resume();
+		_exit(0);
+	}
+	int status = 0;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void touch(void* stack, size_t size) {
+	memset(stack, 0xcc, size);
+}
+
+// 只能在第一个栈分配之前设置, 之后的协程都用 MMAP 分配
+static void testStackPool() {
+	assert(StackPool::SetMode(StackPool::MMAP, StackPool::GUARD_PAGE | StackPool::TRANSPARENT_HUGEPAGE | StackPool::HUGETLB));
+	assert(StackPool::GetMode() == StackPool::MMAP);
+	assert(StackPool::DefaultSize() == (1 << 20));
+
+	// 向上取整到 2 的幂, 最小 32K; 超过 1M 的保持原样
+	const size_t sizes[][2] = {
+		{1, 32 << 10},
+		{32 << 10, 32 << 10},
+		{(32 << 10) + 1, 64 << 10},
+		{100000, 128 << 10},
+		{1 << 20, 1 << 20},
+		{(1 << 20) + 1, (1 << 20) + 1},
+	};
+	for (auto& s : sizes) {
+		size_t size = s[0];
+		void* stack = StackPool::Alloc(size);
+		assert(stack && size == s[1]);
+		touch(stack, size);
+		StackPool::Dealloc(stack, size);
+	}
+	assert(!StackPool::SetMode(StackPool::MALLOC));
+	assert(StackPool::GetMode() == StackPool::MMAP);
+
+	// 释放后同一个线程再要同级别的栈, 拿回刚还的那个
+	size_t size = 40000;
+	void* first = StackPool::Alloc(size);
+	StackPool::Dealloc(first, size);
+	size_t again = 50000;
+	assert(StackPool::Alloc(again) == first && again == size);
+	StackPool::Dealloc(first, again);
+
+	// 栈底下面是保护页, 写越界直接 SIGSEGV
+	void* stack = StackPool::Alloc(size);
+	pid_t pid = fork();
+	if (pid == 0) {
+		((volatile char*)stack)[-1] = 1;
+		_exit(0);
+	}
+	int status = 0;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+	StackPool::Dealloc(stack, size);
+
+	// 2M 的整数倍尝试大页, 没有预留大页时回退到普通页, 都要能用
+	size = 4 << 20;
+	stack = StackPool::Alloc(size);
+	assert(size == (4 << 20));
+	touch(stack, size);
+	StackPool::Dealloc(stack, size);
+}
+
 int main() {
+	testStackPool();
 	Fiber::GetThis();
 
 	Scheduler sc;
@@ -38,5 +426,20 @@ int main() {
 		sc.schedule(fiber);
 	}
 	sc.run();
+
+	for (bool shared_stack : {false, true}) {
+#if defined(__x86_64__) || defined(__aarch64__)
+		testCalleeSaved(shared_stack);
+#endif
+		testFloat(shared_stack);
+		// 大小不是 16 的倍数, 超过最大级别的栈不取整
+		testAlignment(0, shared_stack);
+		testAlignment((1 << 20) + 12345, shared_stack);
+	}
+
+	testSharedStack();
+	testResumeTerminated();
+
+	std::cout << "fiber ok" << std::endl;
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include "hook.h"
 #include "../ioscheduler/ioscheduler.h"
+#include "../ioscheduler/io_uring.h"
 #include <dlfcn.h>
 #include <iostream>
 #include <cstdarg>
@@ -64,17 +65,79 @@ static HookIniter s_hook_initer;
 
 } 
 
-struct timer_info {
-    int cancelled = 0;
+namespace {
+
+// Timeout of one blocking wait, cancelled when it goes out of scope.
+// The node in FdCtx is reused (no allocation per wait) but only by one waiter per direction at a
+// time: a second coroutine blocked on the same fd and direction gets its own heap timer, so it can
+// neither re-arm nor cancel the first one's timeout.
+class WaitTimeout {
+public:
+    WaitTimeout(mushanyu::FdCtx* ctx, int type, mushanyu::IOManager* iom, int fd, mushanyu::IOManager::Event event, uint64_t timeout_ms)
+        : m_wait(ctx->getTimedWait(type)) {
+        if(timeout_ms == (uint64_t)-1) {
+            return;
+        }
+        if(!m_wait.busy.exchange(true, std::memory_order_acquire)) {
+            m_own = true;
+            m_seq = m_wait.seq.fetch_add(1) + 1;
+            // ctx is never freed, a callback from an earlier wait (or an earlier fd with
+            // the same number) may still run, seq filters it
+            uint32_t seq = m_seq;
+            iom->addTimer(&m_wait.timer, timeout_ms, [ctx, type, fd, iom, event, seq]() {
+                mushanyu::FdCtx::TimedWait& wait = ctx->getTimedWait(type);
+                if(wait.seq.load() != seq) {
+                    return;
+                }
+                wait.timedOutSeq.store(seq);
+                iom->cancelEvent(fd, event);
+            });
+        } else {
+            std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+            m_flag = flag;
+            m_timer = iom->addTimer(timeout_ms, [flag, fd, iom, event]() {
+                flag->store(true);
+                iom->cancelEvent(fd, event);
+            });
+        }
+    }
+
+    ~WaitTimeout() {
+        if(m_own) {
+            m_wait.timer.cancel();
+            m_wait.busy.store(false, std::memory_order_release);
+        } else if(m_timer) {
+            m_timer->cancel();
+        }
+    }
+
+    WaitTimeout(const WaitTimeout&) = delete;
+    WaitTimeout& operator=(const WaitTimeout&) = delete;
+
+    bool timedOut() const {
+        if(m_own) {
+            return m_wait.timedOutSeq.load() == m_seq;
+        }
+        return m_flag && m_flag->load();
+    }
+
+private:
+    mushanyu::FdCtx::TimedWait& m_wait;
+    bool m_own = false;
+    uint32_t m_seq = 0;
+    std::shared_ptr<mushanyu::Timer> m_timer;
+    std::shared_ptr<std::atomic<bool>> m_flag;
 };
 
+}
+
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t event, int timeout_so, Args&&... args)  {
-    if(!sylar::t_hook_enable) {
+    if(!mushanyu::t_hook_enable) {
         return fun(fd, std::forward<Args>(args)...);
     }
 
-    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+    mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(fd);
     if(!ctx) {
         return fun(fd, std::forward<Args>(args)...);
     }
@@ -89,7 +152,8 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
     }
 
     uint64_t timeout = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    // close() bumps it before waking us; the number may already name another fd by the time we run
+    uint32_t generation = ctx->generation();
 
 retry:
     ssize_t n = fun(fd, std::forward<Args>(args)...);
@@ -99,36 +163,24 @@ retry:
     }
     
     if(n == -1 && errno == EAGAIN) {
-        sylar::IOManager* iom = sylar::IOManager::GetThis();
-        std::shared_ptr<sylar::Timer> timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-
-        if(timeout != (uint64_t)-1) {
-            timer = iom->addConditionTimer(timeout, [winfo, fd, iom, event]() {
-                auto t = winfo.lock();
-                if(!t || t->cancelled)  {
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, (sylar::IOManager::Event)(event));
-            }, winfo);
-        }
+        mushanyu::IOManager* iom = mushanyu::IOManager::GetThis();
+        WaitTimeout wait(ctx, timeout_so, iom, fd, (mushanyu::IOManager::Event)(event), timeout);
 
-        int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
-        if(rt) {
+        int rt = iom->addEvent(fd, (mushanyu::IOManager::Event)(event));
+        if(rt == 1) {
+            // persistent registration already saw the fd ready, retry without yielding
+            goto retry;
+        } else if(rt) {
             std::cout << hook_fun_name << " addEvent("<< fd << ", " << event << ")";
-            if(timer)  {
-                timer->cancel();
-            }
             return -1;
         } else {
-            sylar::Fiber::GetThis()->yield();
-     
-            if(timer) {
-                timer->cancel();
+            mushanyu::Fiber::GetThis()->yield();
+            if(ctx->generation() != generation) {
+                errno = EBADF;
+                return -1;
             }
-            if(tinfo->cancelled == ETIMEDOUT) {
-                errno = tinfo->cancelled;
+            if(wait.timedOut()) {
+                errno = ETIMEDOUT;
                 return -1;
             }
             goto retry;
@@ -138,6 +190,48 @@ retry:
 }
 
 
+// io_uring 后端: 直接提交请求, 协程在请求完成时恢复, 不再先等就绪再重试.
+// 不适用(EPOLL 后端、不需要 hook 的 fd 等)或者内核对这个 fd 返回 EAGAIN 时返回 false, 调用方继续走 do_io
+template<typename Prep>
+static bool uring_io(int fd, int timeout_so, ssize_t& result, Prep prep) {
+    if(!mushanyu::t_hook_enable) {
+        return false;
+    }
+    mushanyu::IOManager* iom = mushanyu::IOManager::GetThis();
+    if(!iom) {
+        return false;
+    }
+    mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClosed() || !ctx->isSocket() || ctx->getUserNonblock()) {
+        return false;
+    }
+    io_uring_sqe* sqe = iom->getSqe();
+    if(!sqe) {
+        return false;
+    }
+    prep(sqe);
+    sqe->fd = fd;
+    ctx->addRingOp();
+    int res = iom->waitIo(sqe, ctx->getTimeout(timeout_so));
+    ctx->doneRingOp();
+    if(res == -EAGAIN) {
+        return false;
+    }
+    if(res < 0) {
+        errno = -res;
+        result = -1;
+    } else {
+        result = res;
+    }
+    return true;
+}
+
+static void prep_msg(io_uring_sqe* sqe, uint8_t opcode, const struct msghdr* msg, int flags) {
+    sqe->opcode = opcode;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+}
 
 extern "C"{
 
@@ -163,7 +257,7 @@ int usleep(useconds_t usec) {
 
 	std::shared_ptr<mushanyu::Fiber> fiber = mushanyu::Fiber::GetThis();
 	mushanyu::IOManager* iom = mushanyu::IOManager::GetThis();
-	iom->addTimer(usec/1000, [fiber, iom](){iom->scheduleLock(fiber);});
+	iom->addTimerUs(usec, [fiber, iom](){iom->scheduleLock(fiber);});
 	fiber->yield();
 	return 0;
 }
@@ -173,11 +267,12 @@ int nanosleep(const struct timespec* req, struct timespec* rem){
 		return nanosleep_f(req, rem);
 	}	
 
-	int timeout_ms = req->tv_sec*1000 + req->tv_nsec/1000/1000;
+	// 不足一微秒的部分向上取整, 不能睡得比要求的短
+	uint64_t timeout_us = req->tv_sec*1000000ull + (req->tv_nsec + 999)/1000;
 
 	std::shared_ptr<mushanyu::Fiber> fiber = mushanyu::Fiber::GetThis();
 	mushanyu::IOManager* iom = mushanyu::IOManager::GetThis();
-	iom->addTimer(timeout_ms, [fiber, iom](){iom->scheduleLock(fiber, -1);});
+	iom->addTimerUs(timeout_us, [fiber, iom](){iom->scheduleLock(fiber, -1);});
 	fiber->yield();	
 	return 0;
 }
@@ -201,7 +296,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
-    std::shared_ptr<mushanyu::FdCtx> ctx = mushanyu::FdMgr::GetInstance()->get(fd);
+    mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(fd);
     if(!ctx || ctx->isClosed()) {
         errno = EBADF;
         return -1;
@@ -215,7 +310,31 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
-    int n = connect_f(fd, addr, addrlen);
+    // io_uring 后端直接提交连接请求, 完成时返回; 内核没有替我们等连接完成时按原来的方式等可写
+    int n = -1;
+    mushanyu::IOManager* uring_iom = mushanyu::IOManager::GetThis();
+    io_uring_sqe* sqe = uring_iom ? uring_iom->getSqe() : nullptr;
+    if(sqe) {
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)addr;
+        sqe->off = addrlen;
+        ctx->addRingOp();
+        int res = uring_iom->waitIo(sqe, timeout_ms);
+        ctx->doneRingOp();
+        if(res == 0) {
+            return 0;
+        } else if(res == -EAGAIN) {
+            n = connect_f(fd, addr, addrlen);
+        } else if(res != -EINPROGRESS) {
+            errno = -res;
+            return -1;
+        } else {
+            errno = EINPROGRESS;
+        }
+    } else {
+        n = connect_f(fd, addr, addrlen);
+    }
     if(n == 0) {
         return 0;
     } else if(n != -1 || errno != EINPROGRESS) {
@@ -223,37 +342,22 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     }
 
     mushanyu::IOManager* iom = mushanyu::IOManager::GetThis();
-    std::shared_ptr<mushanyu::Timer> timer;
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-    std::weak_ptr<timer_info> winfo(tinfo);
-
-    if(timeout_ms != (uint64_t)-1) {
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom](){
-            auto t = winfo.lock();
-            if(!t || t->cancelled){
-                return;
-            }
-            t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, mushanyu::IOManager::WRITE);
-        }, winfo);
-    }
+    WaitTimeout wait(ctx, SO_SNDTIMEO, iom, fd, mushanyu::IOManager::WRITE, timeout_ms);
+    uint32_t generation = ctx->generation();
 
     int rt = iom->addEvent(fd, mushanyu::IOManager::WRITE);
     if(rt == 0) {
         mushanyu::Fiber::GetThis()->yield();
-        if(timer) {
-            timer->cancel();
-        }
-
-        if(tinfo->cancelled) {
-            errno = tinfo->cancelled;
+        if(ctx->generation() != generation) {
+            errno = EBADF;
             return -1;
         }
-    } else {
-        if(timer) 
-        {
-            timer->cancel();
+        if(wait.timedOut()) {
+            errno = ETIMEDOUT;
+            return -1;
         }
+    } else if(rt != 1) {
+        // rt == 1: already writable, go straight to SO_ERROR
         std::cerr << "connect addEvent(" << fd << ", WRITE) error";
     }
 
@@ -277,7 +381,14 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen){
 }
 
 int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen){
-	int fd = do_io(sockfd, accept_f, "accept", mushanyu::IOManager::READ, SO_RCVTIMEO, addr, addrlen);	
+	ssize_t fd;
+	if(!uring_io(sockfd, SO_RCVTIMEO, fd, [&](io_uring_sqe* sqe) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->addr = (uint64_t)(uintptr_t)addr;
+		sqe->addr2 = (uint64_t)(uintptr_t)addrlen;
+	})) {
+		fd = do_io(sockfd, accept_f, "accept", mushanyu::IOManager::READ, SO_RCVTIMEO, addr, addrlen);	
+	}
 	if(fd>=0){
 		mushanyu::FdMgr::GetInstance()->get(fd, true);
 	}
@@ -285,42 +396,121 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen){
 }
 
 ssize_t read(int fd, void *buf, size_t count){
+	ssize_t n;
+	if(uring_io(fd, SO_RCVTIMEO, n, [&](io_uring_sqe* sqe) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = count;
+	})) {
+		return n;
+	}
 	return do_io(fd, read_f, "read", mushanyu::IOManager::READ, SO_RCVTIMEO, buf, count);	
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt){
+	ssize_t n;
+	struct msghdr msg{};
+	msg.msg_iov = const_cast<struct iovec*>(iov);
+	msg.msg_iovlen = iovcnt;
+	if(uring_io(fd, SO_RCVTIMEO, n, [&](io_uring_sqe* sqe) {prep_msg(sqe, IORING_OP_RECVMSG, &msg, 0);})) {
+		return n;
+	}
 	return do_io(fd, readv_f, "readv", mushanyu::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);	
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags){
+	ssize_t n;
+	if(uring_io(sockfd, SO_RCVTIMEO, n, [&](io_uring_sqe* sqe) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = len;
+		sqe->msg_flags = flags;
+	})) {
+		return n;
+	}
 	return do_io(sockfd, recv_f, "recv", mushanyu::IOManager::READ, SO_RCVTIMEO, buf, len, flags);	
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen){
+	ssize_t n;
+	struct iovec iov = {buf, len};
+	struct msghdr msg{};
+	msg.msg_name = src_addr;
+	msg.msg_namelen = addrlen ? *addrlen : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(uring_io(sockfd, SO_RCVTIMEO, n, [&](io_uring_sqe* sqe) {prep_msg(sqe, IORING_OP_RECVMSG, &msg, flags);})) {
+		if(n >= 0 && addrlen) {
+			*addrlen = msg.msg_namelen;
+		}
+		return n;
+	}
 	return do_io(sockfd, recvfrom_f, "recvfrom", mushanyu::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);	
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags){
+	ssize_t n;
+	if(uring_io(sockfd, SO_RCVTIMEO, n, [&](io_uring_sqe* sqe) {prep_msg(sqe, IORING_OP_RECVMSG, msg, flags);})) {
+		return n;
+	}
 	return do_io(sockfd, recvmsg_f, "recvmsg", mushanyu::IOManager::READ, SO_RCVTIMEO, msg, flags);	
 }
 
 ssize_t write(int fd, const void *buf, size_t count){
+	ssize_t n;
+	if(uring_io(fd, SO_SNDTIMEO, n, [&](io_uring_sqe* sqe) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = count;
+	})) {
+		return n;
+	}
 	return do_io(fd, write_f, "write", mushanyu::IOManager::WRITE, SO_SNDTIMEO, buf, count);	
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt){
+	ssize_t n;
+	struct msghdr msg{};
+	msg.msg_iov = const_cast<struct iovec*>(iov);
+	msg.msg_iovlen = iovcnt;
+	if(uring_io(fd, SO_SNDTIMEO, n, [&](io_uring_sqe* sqe) {prep_msg(sqe, IORING_OP_SENDMSG, &msg, 0);})) {
+		return n;
+	}
 	return do_io(fd, writev_f, "writev", mushanyu::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);	
 }
 
 ssize_t send(int sockfd, const void *buf, size_t len, int flags){
+	ssize_t n;
+	if(uring_io(sockfd, SO_SNDTIMEO, n, [&](io_uring_sqe* sqe) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = len;
+		sqe->msg_flags = flags;
+	})) {
+		return n;
+	}
 	return do_io(sockfd, send_f, "send", mushanyu::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags);	
 }
 
 ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen){
+	ssize_t n;
+	struct iovec iov = {const_cast<void*>(buf), len};
+	struct msghdr msg{};
+	msg.msg_name = const_cast<struct sockaddr*>(dest_addr);
+	msg.msg_namelen = addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(uring_io(sockfd, SO_SNDTIMEO, n, [&](io_uring_sqe* sqe) {prep_msg(sqe, IORING_OP_SENDMSG, &msg, flags);})) {
+		return n;
+	}
 	return do_io(sockfd, sendto_f, "sendto", mushanyu::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags, dest_addr, addrlen);	
 }
 
 ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags){
+	ssize_t n;
+	if(uring_io(sockfd, SO_SNDTIMEO, n, [&](io_uring_sqe* sqe) {prep_msg(sqe, IORING_OP_SENDMSG, msg, flags);})) {
+		return n;
+	}
 	return do_io(sockfd, sendmsg_f, "sendmsg", mushanyu::IOManager::WRITE, SO_SNDTIMEO, msg, flags);	
 }
 
@@ -329,14 +519,21 @@ int close(int fd){
 		return close_f(fd);
 	}	
 
-	std::shared_ptr<mushanyu::FdCtx> ctx = mushanyu::FdMgr::GetInstance()->get(fd);
+	mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(fd);
 
 	if(ctx){
+		// closed first, so a waiter woken below returns EBADF instead of retrying on this number
+		mushanyu::FdMgr::GetInstance()->del(fd);
 		auto iom = mushanyu::IOManager::GetThis();
 		if(iom){	
+			// requests parked in an io_uring only complete when the socket does: cancel our own ones
+			// and wait for them while the fd still names this socket. No shutdown(), the socket may
+			// be shared through dup, fork or SCM_RIGHTS
+			if(ctx->hasRingOps()){
+				iom->cancelRingIo(fd);
+			}
 			iom->cancelAll(fd);
 		}
-		mushanyu::FdMgr::GetInstance()->del(fd);
 	}
 	return close_f(fd);
 }
@@ -349,7 +546,7 @@ int fcntl(int fd, int cmd, ... /* arg */ ){
             {
                 int arg = va_arg(va, int); 
                 va_end(va);
-                std::shared_ptr<mushanyu::FdCtx> ctx = mushanyu::FdMgr::GetInstance()->get(fd);
+                mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(fd);
                 if(!ctx || ctx->isClosed() || !ctx->isSocket()) {
                     return fcntl_f(fd, cmd, arg);
                 }
@@ -367,7 +564,7 @@ int fcntl(int fd, int cmd, ... /* arg */ ){
             {
                 va_end(va);
                 int arg = fcntl_f(fd, cmd);
-                std::shared_ptr<mushanyu::FdCtx> ctx = mushanyu::FdMgr::GetInstance()->get(fd);
+                mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(fd);
                 if(!ctx || ctx->isClosed() || !ctx->isSocket()) {
                     return arg;
                 }
@@ -443,7 +640,7 @@ int ioctl(int fd, unsigned long request, ...) {
 
     if(FIONBIO == request) {
         bool user_nonblock = !!*(int*)arg;
-        std::shared_ptr<mushanyu::FdCtx> ctx = mushanyu::FdMgr::GetInstance()->get(fd);
+        mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(fd);
         if(!ctx || ctx->isClosed() || !ctx->isSocket()) {
             return ioctl_f(fd, request, arg);
         }
@@ -463,7 +660,7 @@ int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t
 
     if(level == SOL_SOCKET) {
         if(optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
-            std::shared_ptr<mushanyu::FdCtx> ctx = mushanyu::FdMgr::GetInstance()->get(sockfd);
+            mushanyu::FdCtx* ctx = mushanyu::FdMgr::GetInstance()->get(sockfd);
             if(ctx) {
                 const timeval* v = (const timeval*)optval;
                 ctx->setTimeout(optname, v->tv_sec * 1000 + v->tv_usec / 1000);
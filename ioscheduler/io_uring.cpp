@@ -0,0 +1,138 @@
+#include "io_uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+namespace mushanyu {
+    IoUring::~IoUring() {
+        if (sqes_) {
+            munmap(sqes_, sqesSize_);
+        }
+        if (cqRing_ && cqRing_ != sqRing_) {
+            munmap(cqRing_, cqRingSize_);
+        }
+        if (sqRing_) {
+            munmap(sqRing_, sqRingSize_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool IoUring::init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd_ < 0) {
+            return false;
+        }
+        // 等待时带超时需要 IORING_ENTER_EXT_ARG (5.11)
+        if (!(params.features & IORING_FEAT_EXT_ARG)) {
+            return false;
+        }
+
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        }
+        sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sqRing_ == MAP_FAILED) {
+            sqRing_ = nullptr;
+            return false;
+        }
+        if (single_mmap) {
+            cqRing_ = sqRing_;
+        } else {
+            cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if (cqRing_ == MAP_FAILED) {
+                cqRing_ = nullptr;
+                return false;
+            }
+        }
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        sqes_ = (io_uring_sqe*) sqes;
+
+        char* sq = (char*) sqRing_;
+        sqHead_ = (unsigned*) (sq + params.sq_off.head);
+        sqTail_ = (unsigned*) (sq + params.sq_off.tail);
+        sqMask_ = *(unsigned*) (sq + params.sq_off.ring_mask);
+        sqEntries_ = *(unsigned*) (sq + params.sq_off.ring_entries);
+        // SQE 按顺序使用, 索引数组固定为恒等映射
+        unsigned* array = (unsigned*) (sq + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries_; ++i) {
+            array[i] = i;
+        }
+        sqeHead_ = sqeTail_ = *sqTail_;
+
+        char* cq = (char*) cqRing_;
+        cqHead_ = (unsigned*) (cq + params.cq_off.head);
+        cqTail_ = (unsigned*) (cq + params.cq_off.tail);
+        cqMask_ = *(unsigned*) (cq + params.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+        return true;
+    }
+
+    io_uring_sqe* IoUring::getSqe(unsigned n) {
+        unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (sqeTail_ + n - head > sqEntries_) {
+            submit();
+            head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+            if (sqeTail_ + n - head > sqEntries_) {
+                return nullptr;
+            }
+        }
+        io_uring_sqe* sqe = &sqes_[sqeTail_ & sqMask_];
+        memset(sqe, 0, sizeof(*sqe));
+        ++sqeTail_;
+        return sqe;
+    }
+
+    unsigned IoUring::flush() {
+        if (sqeTail_ != sqeHead_) {
+            __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+            sqeHead_ = sqeTail_;
+        }
+        // 之前被信号打断没交出去的也算上
+        return sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    }
+
+    int IoUring::enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz) {
+        return syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, arg, argsz);
+    }
+
+    int IoUring::submit() {
+        unsigned n = flush();
+        if (!n) {
+            return 0;
+        }
+        int rt;
+        do {
+            rt = enter(n, 0, 0, nullptr, 0);
+        } while (rt < 0 && errno == EINTR);
+        return rt;
+    }
+
+    int IoUring::submitAndWait(uint64_t timeout_us) {
+        unsigned n = flush();
+        __kernel_timespec ts;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        if (timeout_us != ~0ull) {
+            ts.tv_sec = timeout_us / 1000000;
+            ts.tv_nsec = (timeout_us % 1000000) * 1000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+        return enter(n, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+}
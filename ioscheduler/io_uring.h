@@ -0,0 +1,73 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace mushanyu {
+    /***
+     * @description: 直接用系统调用操作的 io_uring, 不依赖 liburing
+     * 提交队列和完成队列都只由一个线程使用, 不加锁. 取出的 SQE 先攒着, submit() 时一次性交给内核.
+     */
+    class IoUring {
+    public:
+        IoUring() = default;
+        ~IoUring();
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        // 内核不支持 io_uring 或者缺少需要的特性(带超时的等待)时返回 false
+        bool init(unsigned entries);
+
+        // 保证至少有 n 个空闲 SQE, 返回第一个(已清零); 空闲不够时先提交, 仍然不够返回 nullptr
+        // 链接的请求用 n = 2 取第一个, 第二个再取时不会触发提交, 两个一定在同一批里
+        io_uring_sqe* getSqe(unsigned n = 1);
+        // 已经取出还没交给内核的 SQE 数
+        unsigned pending() const {return sqeTail_ - sqeHead_;}
+
+        int submit();
+        // 提交并等待至少一个完成事件, 微秒, ~0ull 表示不超时; 超时返回 -1, errno 为 ETIME
+        int submitAndWait(uint64_t timeout_us);
+
+        // 依次处理已完成的事件, 返回处理的个数
+        template <class F>
+        unsigned reap(F&& f) {
+            unsigned head = *cqHead_;
+            unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            unsigned n = 0;
+            for (; head != tail; ++head, ++n) {
+                f(cqes_[head & cqMask_]);
+            }
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+            return n;
+        }
+
+    private:
+        // 把取出的 SQE 发布给内核, 返回内核还没取走的个数
+        unsigned flush();
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz);
+
+        int fd_ = -1;
+
+        void* sqRing_ = nullptr;
+        size_t sqRingSize_ = 0;
+        void* cqRing_ = nullptr;
+        size_t cqRingSize_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        size_t sqesSize_ = 0;
+
+        unsigned* sqHead_ = nullptr;
+        unsigned* sqTail_ = nullptr;
+        unsigned sqMask_ = 0;
+        unsigned sqEntries_ = 0;
+        // [sqeHead_, sqeTail_) 是已经取出还没发布的 SQE
+        unsigned sqeHead_ = 0;
+        unsigned sqeTail_ = 0;
+
+        unsigned* cqHead_ = nullptr;
+        unsigned* cqTail_ = nullptr;
+        unsigned cqMask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+    };
+}
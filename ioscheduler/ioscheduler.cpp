@@ -1,13 +1,28 @@
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <fcntl.h>
 #include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
 
 #include "ioscheduler.h"
+#include "io_uring.h"
 
 static bool debnug = true;
 
 namespace mushanyu {
+    // ring 上 epfd 的 poll 请求和链接超时请求的 user_data, IoRequest 的地址不会是这两个值
+    static const uint64_t kEpollPollTag = 1;
+    static const uint64_t kIgnoreTag = 2;
+    // 每个 ring 的 SQE 数
+    static const unsigned kRingEntries = 256;
+    // 攒够这么多请求时不等 idle, 直接提交
+    static const unsigned kSubmitBatch = 32;
+
     IOManager* IOManager::GetThis() {
         return dynamic_cast<IOManager*>(Scheduler::GetThis());
     }
@@ -25,120 +40,189 @@ namespace mushanyu {
 
     void IOManager::FdContext::resetEventContext(EventContext &ctx) {
         ctx.scheduler = nullptr;
+        ctx.thread = -1;
         ctx.fiber.reset();
         ctx.cb = nullptr;
     }
 
-    void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+    void IOManager::FdContext::triggerEvent(IOManager::Event event, TaskBatch* batch) {
         assert(events & event);
         events = (Event)(events & ~event);
 
         EventContext& ctx = getEventContext(event);
-        if (ctx.cb) {
-            ctx.scheduler->scheduleLock(&ctx.cb);
+        if (batch && ctx.scheduler == batch->scheduler && ctx.thread == batch->thread) {
+            if (ctx.cb) {
+                batch->cbs.push_back(std::move(ctx.cb));
+            } else {
+                batch->fibers.push_back(std::move(ctx.fiber));
+            }
+        } else if (ctx.cb) {
+            ctx.scheduler->scheduleLock(&ctx.cb, ctx.thread);
         } else {
-            ctx.scheduler->scheduleLock(&ctx.fiber);
+            ctx.scheduler->scheduleLock(&ctx.fiber, ctx.thread);
         }
 
         resetEventContext(ctx);
     }
 
-    IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
-        : Scheduler(threads, use_caller, name), TimerManager() {
-            epfd_ = epoll_create(5000);
-            assert(epfd_ > 0);
-            int rt = pipe(tickleFds_);
-            assert(!rt);
-
-            epoll_event event{};
-            event.events = EPOLLIN | EPOLLET;
-            event.data.fd = tickleFds_[0];
-            rt = fcntl(tickleFds_[0], F_SETFL, O_NONBLOCK);
-            assert(!rt);
-
-            rt = epoll_ctl(epfd_, EPOLL_CTL_ADD, tickleFds_[0], &event);
-            assert(!rt);
+    IOManager::IOManager(size_t threads, bool use_caller, const std::string& name,
+                         TimerManager::Backend timer_backend, uint64_t timer_tick_ms, IoBackend io_backend, bool sharded,
+                         bool bind_thread)
+        : Scheduler(threads, use_caller, name, bind_thread), TimerManager(timer_backend, timer_tick_ms) {
+            sharded_ = sharded && workerCount() > 1;
+            size_t reactors = sharded_ ? workerCount() : 1;
+            for (size_t i = 0; i < reactors; ++i) {
+                std::unique_ptr<Reactor> reactor(new Reactor);
+                reactor->epfd = epoll_create(5000);
+                assert(reactor->epfd > 0);
+                // 信号量语义, 每次 read 只取走一次唤醒; 水平触发, 一个线程取走一次之后内核会接着叫醒下一个等待者
+                reactor->tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE);
+                assert(reactor->tickleFd >= 0);
+
+                epoll_event event{};
+                event.events = EPOLLIN;
+                event.data.fd = reactor->tickleFd;
+
+                int rt = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->tickleFd, &event);
+                assert(!rt);
+                reactors_.push_back(std::move(reactor));
+            }
 
-            contextResize(32);
+            // 每个工作线程一个私有定时器分片
+            setTimerShards(workerCount());
+
+            persistent_ = io_backend == EPOLL_PERSISTENT;
+            if (io_backend == URING) {
+                for (size_t i = 0; i < workerCount(); ++i) {
+                    std::unique_ptr<WorkerRing> wr(new WorkerRing);
+                    wr->reactor = reactors_[sharded_ ? i : 0].get();
+                    wr->ring.reset(new IoUring);
+                    if (!wr->ring->init(kRingEntries)) {
+                        std::cerr << "IOManager: io_uring unavailable, falling back to epoll" << std::endl;
+                        rings_.clear();
+                        break;
+                    }
+                    armEpollPoll(*wr);
+                    wr->ring->submit();
+                    rings_.push_back(std::move(wr));
+                }
+            }
 
             start();
     }
 
     IOManager::~IOManager() {
         stop();
-        close(epfd_);
-        close(tickleFds_[0]);
-        close(tickleFds_[1]);
-
-        for (size_t i = 0; i < fdContexts_.size(); ++i) {
-            if (fdContexts_[i]) {
-                delete fdContexts_[i];
-            }
+        // ring 里还挂着对 epfd 的 poll, 先关 ring
+        rings_.clear();
+        for (auto& reactor : reactors_) {
+            close(reactor->epfd);
+            close(reactor->tickleFd);
         }
     }
 
-    void IOManager::contextResize(size_t size) {
-        fdContexts_.resize(size);
-        for (size_t i = 0; i < fdContexts_.size(); ++i) {
-            if (!fdContexts_[i]) {
-                fdContexts_[i] = new FdContext;
-                fdContexts_[i]->fd = i;
+    IOManager::Reactor& IOManager::bindReactor(FdContext* fd_ctx) {
+        if (fd_ctx->owner < 0) {
+            int self = currentWorker();
+            if (!sharded_) {
+                fd_ctx->owner = 0;
+            } else if (self >= 0) {
+                fd_ctx->owner = self;
+            } else {
+                fd_ctx->owner = nextReactor();
             }
         }
+        return *reactors_[fd_ctx->owner];
     }
 
-    int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-        FdContext* fd_ctx = nullptr;
+    int IOManager::nextReactor() {
+        // use_caller 时 0 号工作线程在 stop() 之前不运行调度, 不往它上面分
+        size_t first = callerIsWorker() && reactors_.size() > 1 ? 1 : 0;
+        return first + nextReactor_++ % (reactors_.size() - first);
+    }
 
-        std::shared_lock<std::shared_mutex> read_lock(mutex_);
-        if ((int) fdContexts_.size() > fd) {
-            fd_ctx = fdContexts_[fd];
-            read_lock.unlock();
-        } else {
-            read_lock.unlock();
-            std::unique_lock<std::shared_mutex> write_lock(mutex_);
-            contextResize(fd * 1.5);
-            fd_ctx = fdContexts_[fd];
+    int IOManager::addEvent(int fd, Event event, Callback cb) {
+        FdContext* fd_ctx = fdContexts_.getOrCreate(fd, [](FdContext& ctx, int i) {ctx.fd = i;});
+        if (!fd_ctx) {
+            std::cerr << "addEvent: fd " << fd << " out of range" << std::endl;
+            return -1;
         }
 
         std::lock_guard<std::mutex> lock(fd_ctx->mutex);
         if (fd_ctx->events & event) {
             return -1;
         }
+        if (persistent_) {
+            return addPersistentEvent(fd_ctx, event, std::move(cb));
+        }
         int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
         epoll_event epevent{};
         epevent.events = EPOLLET | fd_ctx->events | event;
         epevent.data.ptr = fd_ctx;
         
-        int rt = epoll_ctl(epfd_, op, fd, &epevent);
+        int rt = epoll_ctl(bindReactor(fd_ctx).epfd, op, fd, &epevent);
         if (rt) {
             std::cerr << "addEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
             return -1;
         }
 
+        addWaiter(fd_ctx, event, cb);
+        return 0;
+    }
+
+    int IOManager::addPersistentEvent(FdContext* fd_ctx, Event event, Callback cb) {
+        if (!fd_ctx->registered) {
+            epoll_event epevent{};
+            epevent.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(bindReactor(fd_ctx).epfd, EPOLL_CTL_ADD, fd_ctx->fd, &epevent);
+            if (rt) {
+                std::cerr << "addEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
+            fd_ctx->registered = true;
+            fd_ctx->ready = NONE;
+        }
+        // 上次没人等的时候已经就绪过, 不用再等
+        if (fd_ctx->ready & event) {
+            fd_ctx->ready &= ~event;
+            if (!cb) {
+                return 1;
+            }
+            // 调用方可能不在任何调度器的线程上
+            scheduleLock(std::move(cb), sharded_ ? workerThreadId(fd_ctx->owner) : -1);
+            return 0;
+        }
+        addWaiter(fd_ctx, event, cb);
+        return 0;
+    }
+
+    void IOManager::addWaiter(FdContext* fd_ctx, Event event, Callback& cb) {
         ++ pendingEventCount_;
 
         fd_ctx->events = (Event)(fd_ctx->events | event);
 
         FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
-        event_ctx.scheduler = Scheduler::GetThis();
+        // 不在任何调度器的线程上登记的回调由本 IOManager 调度
+        event_ctx.scheduler = Scheduler::GetThis() ? Scheduler::GetThis() : this;
         if (cb) {
             event_ctx.cb.swap(cb);
         } else {
             event_ctx.fiber = Fiber::GetThis();
             assert(event_ctx.fiber->getState() == Fiber::State::RUNNING);
         }
-        return 0;
+        // sharded 时回到 fd 所属的工作线程上恢复; 共享栈协程只能回到它绑定的线程
+        if (sharded_ && event_ctx.scheduler == this) {
+            int bound = event_ctx.fiber ? event_ctx.fiber->getBoundThread() : -1;
+            event_ctx.thread = bound != -1 ? bound : workerThreadId(fd_ctx->owner);
+            // start() 之后每个工作线程的 id 都已登记
+            assert(event_ctx.thread != -1);
+        }
     }
 
     bool IOManager::delEvent(int fd, Event event) {
-        FdContext* fd_ctx = nullptr;
-        std::shared_lock<std::shared_mutex> read_lock(mutex_);
-        if ((int) fdContexts_.size() > fd) {
-            fd_ctx = fdContexts_[fd];
-            read_lock.unlock();
-        } else {
-            read_lock.unlock();
+        FdContext* fd_ctx = fdContexts_.get(fd);
+        if (!fd_ctx) {
             return false;
         }
         std::lock_guard<std::mutex> lock(fd_ctx->mutex);
@@ -146,14 +230,16 @@ namespace mushanyu {
             return false;
         }
         Event new_events = (Event)(fd_ctx->events & ~event);
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event epevent{};
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-        int rt = epoll_ctl(epfd_, op, fd, &epevent);
-        if (rt) {
-            std::cerr << "delEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
-            return false;
+        if (!persistent_) {
+            int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+            epoll_event epevent{};
+            epevent.events = EPOLLET | new_events;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(reactors_[fd_ctx->owner]->epfd, op, fd, &epevent);
+            if (rt) {
+                std::cerr << "delEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return false;
+            }
         }
         -- pendingEventCount_;
         fd_ctx->events = new_events;
@@ -163,46 +249,46 @@ namespace mushanyu {
     }
 
     bool IOManager::cancelEvent(int fd, Event event) {
-        FdContext* fd_ctx = nullptr;
-        std::shared_lock<std::shared_mutex> read_lock(mutex_);
-        if ((int) fdContexts_.size() > fd) {
-            fd_ctx = fdContexts_[fd];
-            read_lock.unlock();
-        } else {
-            read_lock.unlock();
+        FdContext* fd_ctx = fdContexts_.get(fd);
+        if (!fd_ctx) {
             return false;
         }
         std::lock_guard<std::mutex> lock(fd_ctx->mutex);
         if (!(fd_ctx->events & event)) {
             return false;
         }
-        Event new_events = (Event)(fd_ctx->events & ~event);
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event epevent{};
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-        int rt = epoll_ctl(epfd_, op, fd, &epevent);
-        if (rt) {
-            std::cerr << "cancelEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
-            return false;
+        if (!persistent_) {
+            Event new_events = (Event)(fd_ctx->events & ~event);
+            int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+            epoll_event epevent{};
+            epevent.events = EPOLLET | new_events;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(reactors_[fd_ctx->owner]->epfd, op, fd, &epevent);
+            if (rt) {
+                std::cerr << "cancelEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return false;
+            }
         }
+        // 和 delEvent 不同, 等待的协程要被唤醒, 否则超时的 IO 永远不会返回
+        fd_ctx->triggerEvent(event);
         -- pendingEventCount_;
-        fd_ctx->events = new_events;
         return true;
     }
 
     bool IOManager::cancelAll(int fd) {
-        FdContext* fd_ctx = nullptr;
-        std::shared_lock<std::shared_mutex> read_lock(mutex_);
-        if ((int) fdContexts_.size() > fd) {
-            fd_ctx = fdContexts_[fd];
-            read_lock.unlock();
-        } else {
-            read_lock.unlock();
+        FdContext* fd_ctx = fdContexts_.get(fd);
+        if (!fd_ctx) {
             return false;
         }
         std::lock_guard<std::mutex> lock(fd_ctx->mutex);
-        if (!fd_ctx->events) {
+        if (fd_ctx->listener) {
+            removeListener(fd_ctx);
+            return true;
+        }
+        // 常驻注册的 fd 即使没人等也要注销, fd 号复用时才会重新注册
+        if (!fd_ctx->events && !fd_ctx->registered) {
+            // 之后复用这个 fd 号的连接重新绑定工作线程
+            fd_ctx->owner = -1;
             return false;
         }
         int op = EPOLL_CTL_DEL;
@@ -210,7 +296,10 @@ namespace mushanyu {
         epevent.events = 0;
         epevent.data.ptr = fd_ctx;
 
-        int rt = epoll_ctl(epfd_, op, fd, &epevent);
+        int rt = epoll_ctl(reactors_[fd_ctx->owner]->epfd, op, fd, &epevent);
+        fd_ctx->registered = false;
+        fd_ctx->ready = NONE;
+        fd_ctx->owner = -1;
         if (rt) {
             std::cerr << "IOManager::epoll_ctl failed: " << strerror(errno) << std::endl;
             return false;
@@ -227,22 +316,167 @@ namespace mushanyu {
         return true;
     }
 
+    bool IOManager::addListener(int fd, AcceptHandler handler) {
+        FdContext* fd_ctx = fdContexts_.getOrCreate(fd, [](FdContext& ctx, int i) {ctx.fd = i;});
+        if (!fd_ctx) {
+            std::cerr << "addListener: fd " << fd << " out of range" << std::endl;
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        if (fd_ctx->listener || fd_ctx->events || fd_ctx->registered) {
+            return false;
+        }
+        // 一次取完积压的连接要靠 accept4 返回 EAGAIN 结束
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            std::cerr << "addListener::fcntl failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        std::shared_ptr<Listener> listener(new Listener);
+        listener->fd = fd;
+        listener->handler = std::move(handler);
+        // 先挂上再注册, 事件到来时一定能看到
+        fd_ctx->listener = listener;
+
+        // 每个 reactor 上都注册, EPOLLEXCLUSIVE 让一个新连接只唤醒其中一个(单个 epoll 时只唤醒一个线程);
+        // 边沿触发, 被唤醒的线程一直 accept 到 EAGAIN
+        for (size_t i = 0; i < reactors_.size(); ++i) {
+            epoll_event epevent{};
+            epevent.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(reactors_[i]->epfd, EPOLL_CTL_ADD, fd, &epevent);
+            if (rt && errno == EINVAL) {
+                // 内核不支持 EPOLLEXCLUSIVE (4.5 之前)
+                epevent.events &= ~EPOLLEXCLUSIVE;
+                rt = epoll_ctl(reactors_[i]->epfd, EPOLL_CTL_ADD, fd, &epevent);
+            }
+            if (rt) {
+                std::cerr << "addListener::epoll_ctl failed: " << strerror(errno) << std::endl;
+                for (size_t j = 0; j < i; ++j) {
+                    epoll_ctl(reactors_[j]->epfd, EPOLL_CTL_DEL, fd, nullptr);
+                }
+                fd_ctx->listener.reset();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool IOManager::delListener(int fd) {
+        FdContext* fd_ctx = fdContexts_.get(fd);
+        if (!fd_ctx) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        if (!fd_ctx->listener) {
+            return false;
+        }
+        removeListener(fd_ctx);
+        return true;
+    }
+
+    void IOManager::removeListener(FdContext* fd_ctx) {
+        for (auto& reactor : reactors_) {
+            epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd_ctx->fd, nullptr);
+        }
+        std::shared_ptr<Listener> listener;
+        listener.swap(fd_ctx->listener);
+        listener->closed.store(true, std::memory_order_seq_cst);
+        // 注销前已经取到事件的线程可能还在 accept4, 等它们看到 closed 退出
+        while (listener->active.load(std::memory_order_seq_cst)) {
+            std::this_thread::yield();
+        }
+    }
+
+    void IOManager::acceptAll(const std::shared_ptr<Listener>& listener, TaskBatch& batch) {
+        listener->active.fetch_add(1, std::memory_order_seq_cst);
+        int self = currentWorker();
+        while (!listener->closed.load(std::memory_order_seq_cst)) {
+            int fd = accept4(listener->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    // 10ms 后在任意工作线程上再取一次
+                    if (!listener->retryArmed.exchange(true, std::memory_order_acq_rel)) {
+                        addTimer(10, [this, listener]() {
+                            listener->retryArmed.store(false, std::memory_order_release);
+                            TaskBatch retry;
+                            acceptAll(listener, retry);
+                            int self = currentWorker();
+                            scheduleBatch(retry.cbs.begin(), retry.cbs.end(), sharded_ ? workerThreadId(self) : -1);
+                        });
+                    }
+                } else if (errno != EAGAIN) {
+                    std::cerr << "IOManager::acceptAll accept4 failed: " << strerror(errno) << std::endl;
+                }
+                break;
+            }
+            Callback cb = [listener, fd]() {
+                listener->handler(fd);
+            };
+            // 共用 epoll 时放进 batch, 空闲线程会来窃取; sharded 时轮流指定给各个工作线程,
+            // 连接之后的 IO 也绑定在那个线程上
+            int target = sharded_ ? nextReactor() : self;
+            if (target == self) {
+                batch.cbs.push_back(std::move(cb));
+            } else {
+                scheduleLock(std::move(cb), workerThreadId(target));
+            }
+        }
+        listener->active.fetch_sub(1, std::memory_order_release);
+    }
+
+    // 只在有线程阻塞在 epoll_wait 里时才写 eventfd, 未处理的唤醒数不超过阻塞的线程数:
+    // 连续 N 次 tickle 最多叫醒 N 个线程, 不会合并成一个
+    bool IOManager::wakeReactor(Reactor& reactor) {
+        int waiters = reactor.waiters.load(std::memory_order_relaxed);
+        int pending = reactor.pendingWakeups.load(std::memory_order_relaxed);
+        do {
+            if (pending >= waiters) {
+                return false;
+            }
+        } while (!reactor.pendingWakeups.compare_exchange_weak(pending, pending + 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+        uint64_t one = 1;
+        int rt = write(reactor.tickleFd, &one, sizeof(one));
+        assert(rt == sizeof(one));
+        return true;
+    }
+
+    // 唤醒一个还有线程没被叫醒的 reactor, sharded 时轮流找
     void IOManager::tickle() {
-        if (hasIdleThreads()) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t count = reactors_.size();
+        size_t start = count > 1 ? nextReactor_++ : 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (wakeReactor(*reactors_[(start + i) % count])) {
+                return;
+            }
+        }
+    }
+
+    // 信箱里的任务只有这个工作线程能取; 共用一个 epoll 时没法指定叫醒谁, 只能叫醒任意一个,
+    // 没取到的线程会在 takeTask() 里看到别人的信箱非空继续唤醒
+    void IOManager::tickleWorker(size_t index) {
+        if (!sharded_) {
+            tickle();
             return;
         }
-        int rt = write(tickleFds_[1], "T", 1);
-        assert(rt == 1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeReactor(*reactors_[index]);
     }
 
     bool IOManager::stopping() {
-        uint64_t timeout = getNextTimer();
-        return timeout == ~0ull && pendingEventCount_ == 0 && Scheduler::stopping();
+        return !hasTimer() && pendingEventCount_ == 0 && Scheduler::stopping();
     }
 
     void IOManager::idle() {
         static const uint64_t MAX_EVENTS = 256;
         std::unique_ptr<epoll_event[]> events(new epoll_event[MAX_EVENTS]);
+        // 每一轮复用, 数组的容量留着给下一轮
+        TaskBatch batch;
+        batch.scheduler = this;
         while (true) {
             if (debug) {
                 std::cout << "IOManager::idle() run in thread " << Thread::GetThreadId() << std::endl;
@@ -250,42 +484,66 @@ namespace mushanyu {
 
             if (stopping()) {
                 if (debug) std::cout << "name = " << getName() << " IOManager::idle() exits in thread " << Thread::GetThreadId() << " stopping" << std::endl;
+                // 其它线程可能还睡在 epoll_wait 里, 依次叫醒它们检查退出
+                tickle();
                 break;
             }
 
             int rt = 0;
+            int self = currentWorker();
+            Reactor& reactor = *reactors_[sharded_ ? self : 0];
+            // sharded 时这里取到的都是绑定在本线程上的 fd, 恢复的任务留在本线程
+            batch.thread = sharded_ ? workerThreadId(self) : -1;
+            WorkerRing* wr = !rings_.empty() && self >= 0 ? rings_[self].get() : nullptr;
             while (true) {
-                static const uint64_t MAX_TIMEOUT = 5000;
-                uint64_t next_timeout = getNextTimer();
+                static const uint64_t MAX_TIMEOUT = 5000 * 1000;
+                // 先登记再检查任务、定时器和退出条件, 和 tickle() 里的检查配对,
+                // 避免登记前入队的任务、新加的定时器或者最后一个任务结束没人唤醒
+                reactor.waiters.fetch_add(1, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                uint64_t next_timeout = getNextTimerUs();
                 next_timeout = std::min(next_timeout, MAX_TIMEOUT);
-
-                rt = epoll_wait(epfd_, events.get(), MAX_EVENTS, (int) next_timeout);
+                if (hasPendingTasks() || stopping()) {
+                    next_timeout = 0;
+                }
+                if (wr) {
+                    rt = waitRing(*wr, events.get(), MAX_EVENTS, next_timeout, batch);
+                } else {
+                    rt = waitEvents(reactor.epfd, events.get(), MAX_EVENTS, next_timeout);
+                }
+                reactor.waiters.fetch_sub(1, std::memory_order_relaxed);
+                // 这一轮处理到期定时器和事件都用这个时间
+                Clock::Refresh();
                 if (rt < 0 && errno == EINTR) {
                     continue;
                 } else {
                     break;
                 }
             }
-            std::vector<std::function<void()>> cbs;
-            listExpiredCb(cbs);
-            if (!cbs.empty()) {
-                for (const auto& cb : cbs) {
-                    scheduleLock(cb);
-                }
-                cbs.clear();
-            }
+            listExpiredCb(batch.cbs);
             for (int i = 0; i < rt; ++i) {
                 epoll_event& event = events[i];
-                if (event.data.fd == tickleFds_[0]) {
-                    uint8_t dummy[256];
-                    while (read(tickleFds_[0], dummy, sizeof(dummy)) > 0) {
-                        
+                if (event.data.fd == reactor.tickleFd) {
+                    // 只取走一次唤醒, 可能已经被同时醒来的其它线程取完
+                    uint64_t dummy;
+                    if (read(reactor.tickleFd, &dummy, sizeof(dummy)) == sizeof(dummy)) {
+                        reactor.pendingWakeups.fetch_sub(1, std::memory_order_release);
                     }
                     continue;
                 }
 
                 FdContext* fd_ctx = (FdContext*) event.data.ptr;
-                std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+                std::unique_lock<std::mutex> lock(fd_ctx->mutex);
+                if (fd_ctx->listener) {
+                    std::shared_ptr<Listener> listener = fd_ctx->listener;
+                    lock.unlock();
+                    acceptAll(listener, batch);
+                    continue;
+                }
+                if (persistent_) {
+                    triggerPersistentEvent(fd_ctx, event.events, batch);
+                    continue;
+                }
                 if (event.events & (EPOLLERR | EPOLLHUP)) {
                     event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
                 }
@@ -303,25 +561,244 @@ namespace mushanyu {
                 int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
                 event.events = EPOLLET | left_events;
 
-                int rt2 = epoll_ctl(epfd_, op, fd_ctx->fd, &event);
+                int rt2 = epoll_ctl(reactor.epfd, op, fd_ctx->fd, &event);
                 if (rt2) {
                     std::cerr << "idle::epoll_ctl failed: " << strerror(errno) << std::endl;
                     continue;
                 }
                 if (real_events & Event::READ) {
-                    fd_ctx->triggerEvent(Event::READ);
+                    fd_ctx->triggerEvent(Event::READ, &batch);
                     -- pendingEventCount_;
                 }
                 if (real_events & Event::WRITE) {
-                    fd_ctx->triggerEvent(Event::WRITE);
+                    fd_ctx->triggerEvent(Event::WRITE, &batch);
                     -- pendingEventCount_;
                 }
             }
+            scheduleBatch(batch.fibers.begin(), batch.fibers.end(), batch.thread);
+            scheduleBatch(batch.cbs.begin(), batch.cbs.end(), batch.thread);
+            batch.fibers.clear();
+            batch.cbs.clear();
             Fiber::GetThis()->yield();
         }
         
     }
 
+    int IOManager::waitEvents(int epfd, epoll_event* events, int max_events, uint64_t timeout_us) {
+#ifdef SYS_epoll_pwait2
+        static std::atomic<bool> s_no_pwait2 = {false};
+        if (!s_no_pwait2.load(std::memory_order_relaxed)) {
+            timespec ts;
+            ts.tv_sec = timeout_us / 1000000;
+            ts.tv_nsec = (timeout_us % 1000000) * 1000;
+            int rt = syscall(SYS_epoll_pwait2, epfd, events, max_events, &ts, nullptr, 0);
+            if (rt >= 0 || errno != ENOSYS) {
+                return rt;
+            }
+            s_no_pwait2.store(true, std::memory_order_relaxed);
+        }
+#endif
+        return epoll_wait(epfd, events, max_events, (int) ((timeout_us + 999) / 1000));
+    }
+
+    // 常驻注册不需要 epoll_ctl, 没有等待者的就绪状态记下来
+    void IOManager::triggerPersistentEvent(FdContext* fd_ctx, uint32_t events, TaskBatch& batch) {
+        int real_events = NONE;
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+            real_events |= Event::READ;
+        }
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            real_events |= Event::WRITE;
+        }
+        fd_ctx->ready |= real_events & ~fd_ctx->events;
+        if (real_events & fd_ctx->events & Event::READ) {
+            fd_ctx->triggerEvent(Event::READ, &batch);
+            -- pendingEventCount_;
+        }
+        if (real_events & fd_ctx->events & Event::WRITE) {
+            fd_ctx->triggerEvent(Event::WRITE, &batch);
+            -- pendingEventCount_;
+        }
+    }
+
+    io_uring_sqe* IOManager::getSqe() {
+        int self = currentWorker();
+        if (rings_.empty() || self < 0 || Fiber::GetThis()->isSharedStack()) {
+            return nullptr;
+        }
+        return rings_[self]->ring->getSqe(2);
+    }
+
+    int IOManager::waitIo(io_uring_sqe* sqe, uint64_t timeout_ms) {
+        int self = currentWorker();
+        WorkerRing& wr = *rings_[self];
+        IoUring* ring = wr.ring.get();
+        IoRequest req;
+        req.fiber = Fiber::GetThis();
+        req.ring = self;
+        sqe->user_data = (uint64_t) (uintptr_t) &req;
+        bool timed = timeout_ms != (uint64_t) -1;
+        if (timed) {
+            req.timeout.tv_sec = timeout_ms / 1000;
+            req.timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+            sqe->flags |= IOSQE_IO_LINK;
+            // getSqe() 预留过, 不会触发提交把两个请求拆开
+            io_uring_sqe* link = ring->getSqe();
+            link->opcode = IORING_OP_LINK_TIMEOUT;
+            link->fd = -1;
+            link->addr = (uint64_t) (uintptr_t) &req.timeout;
+            link->len = 1;
+            link->user_data = kIgnoreTag;
+        }
+        // 登记到 fd 上, 关闭时 cancelRingIo() 能找到它
+        FdContext* fd_ctx = fdContexts_.getOrCreate(sqe->fd, [](FdContext& ctx, int i) {ctx.fd = i;});
+        if (fd_ctx) {
+            std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+            req.next = fd_ctx->ringRequests;
+            if (req.next) {
+                req.next->prev = &req;
+            }
+            fd_ctx->ringRequests = &req;
+        }
+        ++ pendingEventCount_;
+        // ring 上没有别的请求时没有要合并的, 不让它等到 idle
+        if (wr.inflight++ == 0 || ring->pending() >= kSubmitBatch) {
+            ring->submit();
+        }
+        Fiber::GetThis()->yield();
+        bool closing = false;
+        if (fd_ctx) {
+            std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+            if (req.prev) {
+                req.prev->next = req.next;
+            } else {
+                fd_ctx->ringRequests = req.next;
+            }
+            if (req.next) {
+                req.next->prev = req.prev;
+            }
+            closing = req.closing;
+        }
+        if (req.res == -ECANCELED) {
+            // 被 close() 取消
+            if (closing) {
+                return -EBADF;
+            }
+            // 超时后请求被内核取消
+            if (timed) {
+                return -ETIMEDOUT;
+            }
+        }
+        return req.res;
+    }
+
+    void IOManager::cancelRingIo(int fd) {
+        FdContext* fd_ctx = fdContexts_.get(fd);
+        if (!fd_ctx || rings_.empty()) {
+            return;
+        }
+        std::vector<bool> targets(rings_.size(), false);
+        {
+            std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+            for (IoRequest* req = fd_ctx->ringRequests; req; req = req->next) {
+                targets[req->ring] = true;
+            }
+        }
+        // ring 只能由所属线程操作, 别的线程上的请求交给那个线程去取消
+        int self = currentWorker();
+        std::atomic<int> remote = {0};
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (!targets[i]) {
+                continue;
+            }
+            if ((int) i == self) {
+                cancelOnRing(fd_ctx, i);
+                continue;
+            }
+            ++ remote;
+            scheduleInline([this, fd_ctx, i, &remote]() {
+                cancelOnRing(fd_ctx, i);
+                -- remote;
+            }, workerThreadId(i));
+        }
+        // 取消请求都已经发出、被取消的请求都已经完成, 之后 fd 号才能被复用
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+                if (remote == 0 && !fd_ctx->ringRequests) {
+                    break;
+                }
+            }
+            usleep(100);
+        }
+    }
+
+    void IOManager::cancelOnRing(FdContext* fd_ctx, size_t index) {
+        IoUring* ring = rings_[index]->ring.get();
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        for (IoRequest* req = fd_ctx->ringRequests; req; req = req->next) {
+            if (req->ring != (int) index || req->closing) {
+                continue;
+            }
+            io_uring_sqe* sqe = ring->getSqe();
+            if (!sqe) {
+                break;
+            }
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t) (uintptr_t) req;
+            sqe->user_data = kIgnoreTag;
+            req->closing = true;
+        }
+        ring->submit();
+    }
+
+    void IOManager::armEpollPoll(WorkerRing& wr) {
+        io_uring_sqe* sqe = wr.ring->getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wr.reactor->epfd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = multishotPoll_.load(std::memory_order_relaxed) ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = kEpollPollTag;
+    }
+
+    int IOManager::waitRing(WorkerRing& wr, epoll_event* events, int max_events, uint64_t timeout_us, TaskBatch& batch) {
+        bool epoll_ready = wr.epollBacklog;
+        if (epoll_ready) {
+            timeout_us = 0;
+        }
+        int rt = wr.ring->submitAndWait(timeout_us);
+        if (rt < 0 && errno != ETIME && errno != EINTR) {
+            std::cerr << "IOManager::waitRing io_uring_enter failed: " << strerror(errno) << std::endl;
+        }
+        wr.ring->reap([&](const io_uring_cqe& cqe) {
+            if (cqe.user_data == kEpollPollTag) {
+                epoll_ready = true;
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                    if (cqe.res == -EINVAL) {
+                        multishotPoll_.store(false, std::memory_order_relaxed);
+                    }
+                    armEpollPoll(wr);
+                }
+                return;
+            }
+            if (cqe.user_data == kIgnoreTag) {
+                return;
+            }
+            IoRequest* req = (IoRequest*) (uintptr_t) cqe.user_data;
+            req->res = cqe.res;
+            batch.fibers.push_back(std::move(req->fiber));
+            -- pendingEventCount_;
+            -- wr.inflight;
+        });
+        if (!epoll_ready) {
+            return 0;
+        }
+        rt = epoll_wait(wr.reactor->epfd, events, max_events, 0);
+        wr.epollBacklog = rt == max_events;
+        return rt;
+    }
+
     void IOManager::onTimerInsertedAtFront() {
         tickle();
     }
@@ -2,8 +2,16 @@
 
 #include "../scheduler/scheduler.h"
 #include "../timer/timer.h"
+#include "../fd_manager/fd_table.h"
+
+#include <sys/epoll.h>
+#include <linux/time_types.h>
+
+struct io_uring_sqe;
 
 namespace mushanyu {
+    class IoUring;
+
     class IOManager : public Scheduler, public TimerManager {
     public:
         enum  Event{
@@ -12,22 +20,85 @@ namespace mushanyu {
             WRITE = 0x04
         };
 
-        IOManager(size_t threads = 1, bool use_caller = false, const std::string &name = "IOManager");
+        // EPOLL: 等 fd 就绪后再重试系统调用, 每次等待都 EPOLL_CTL_ADD/MOD, 触发后 MOD/DEL
+        // EPOLL_PERSISTENT: 同上, 但 fd 第一次等待时以 EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET 注册一次, 直到 cancelAll();
+        //     没有等待者时到来的就绪状态缓存在 FdContext 里, 之后的等待直接返回. fd 必须经过 cancelAll()
+        //     (被 hook 的 close() 会调用)再关闭, 否则复用同一个 fd 号时不会重新注册
+        // URING: 每个工作线程一个 io_uring, 被 hook 的读写直接提交请求, 完成时恢复协程; 内核不支持时退回 EPOLL
+        enum IoBackend {
+            EPOLL,
+            EPOLL_PERSISTENT,
+            URING
+        };
+
+        // sharded: 每个工作线程一个 epoll, fd 绑定到第一次在它上面等待的工作线程(不在工作线程上时轮流分配),
+        // 就绪事件只由这个线程处理, 等待的协程和回调也在这个线程上恢复, 直到 cancelAll()
+        // bind_thread: 见 Scheduler
+        IOManager(size_t threads = 1, bool use_caller = false, const std::string &name = "IOManager",
+                  TimerManager::Backend timer_backend = TimerManager::TREE, uint64_t timer_tick_ms = 1,
+                  IoBackend io_backend = EPOLL, bool sharded = false, bool bind_thread = true);
         ~IOManager();
 
-        int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+        // 返回 0 成功, -1 失败; EPOLL_PERSISTENT 下 fd 已经就绪时: 有 cb 直接调度 cb 并返回 0,
+        // 没有 cb 时不登记, 返回 1, 调用方应该直接重试而不是 yield
+        int addEvent(int fd, Event event, Callback cb = nullptr);
         bool delEvent(int fd, Event event);
         bool cancelEvent(int fd, Event event);
         bool cancelAll(int fd);
 
+        // 接受连接的回调, 参数是已经设为非阻塞的新连接; 在新协程里运行, 由它负责关闭 fd.
+        // 要在里面使用被 hook 的阻塞 IO, 需要先用 FdMgr 登记这个 fd
+        using AcceptHandler = BasicCallback<int>;
+        // 监听 socket 以 EPOLLEXCLUSIVE 注册到每个 reactor 上, 一个连接只唤醒一个线程;
+        // 被唤醒的线程用 accept4 一次取完积压的连接, 再把它们分给各个工作线程.
+        // 注册后不要再对它调用被 hook 的 accept. 不计入 stopping() 的待处理事件
+        bool addListener(int fd, AcceptHandler handler);
+        // 返回后不会再有线程对 fd 调用 accept4, 可以直接关闭; cancelAll() 也会注销监听
+        bool delListener(int fd);
+
+        // URING 后端下当前工作线程 ring 上的空闲 SQE(已清零), 后面还预留了一个给超时用;
+        // 不在工作线程上、使用 EPOLL 后端或者当前是共享栈协程(栈上的缓冲区切走后无效)时返回 nullptr
+        io_uring_sqe* getSqe();
+        // 提交 getSqe() 取得并填好的请求, 挂起当前协程直到完成, 返回完成事件的 res(失败为 -errno);
+        // timeout_ms 不为 -1 时附加超时, 超时返回 -ETIMEDOUT; 等待期间被 cancelRingIo() 取消返回 -EBADF.
+        // ring 上没有别的请求在等时马上提交, 否则先攒着, 本线程进入 idle 或者攒够一批时一起提交
+        int waitIo(io_uring_sqe* sqe, uint64_t timeout_ms = -1);
+        // 关闭 fd 之前调用: 在各个 ring 上用 ASYNC_CANCEL 取消本 IOManager 提交的、还在等这个 fd 的请求,
+        // 等它们全部完成后返回. 只动自己的请求, 不影响 dup、fork 或 SCM_RIGHTS 共享的同一个 socket.
+        // 要在打开了 hook 的协程里调用, 等待时让出线程给 idle 收割完成事件
+        void cancelRingIo(int fd);
+
         static IOManager* GetThis();
 
     private:
+        // 一轮 epoll_wait 里就绪的任务先攒起来, 最后一次性提交给调度器
+        struct TaskBatch {
+            Scheduler* scheduler = nullptr;
+            // 整批指定运行的线程, -1 表示不指定
+            int thread = -1;
+            std::vector<std::shared_ptr<Fiber>> fibers;
+            std::vector<Callback> cbs;
+        };
+
+        struct Listener {
+            int fd = -1;
+            AcceptHandler handler;
+            // 正在 accept4 的线程数, 注销时等它们退出
+            std::atomic<int> active = {0};
+            std::atomic<bool> closed = {false};
+            // fd 或内存不够时积压的连接还在, 但 EPOLLET 不会再通知, 由定时器稍后重试
+            std::atomic<bool> retryArmed = {false};
+        };
+
+        struct IoRequest;
+
         struct FdContext {
             struct EventContext {
                 Scheduler *scheduler = nullptr;
                 std::shared_ptr<Fiber> fiber;
-                std::function<void()> cb;
+                Callback cb;
+                // 触发后在这个线程上运行, -1 表示不指定
+                int thread = -1;
             };
             
             EventContext read;
@@ -35,27 +106,106 @@ namespace mushanyu {
             EventContext write;
     
             int fd = 0;
+            // 注册在哪个 reactor 上, -1 表示还没绑定
+            int owner = -1;
     
             Event events = NONE;
+            // EPOLL_PERSISTENT: 已经注册到 epoll; 没有等待者时收到的就绪事件
+            bool registered = false;
+            int ready = NONE;
+            // addListener() 注册的监听 socket
+            std::shared_ptr<Listener> listener;
+            // 还在 ring 里等待的请求, 双向链表
+            IoRequest* ringRequests = nullptr;
             std::mutex mutex;
     
             EventContext& getEventContext(Event event);
             void resetEventContext(EventContext &ctx);
-            void triggerEvent(Event event);
+            // 事件所属的调度器就是 batch->scheduler 时放进 batch, 否则直接提交
+            void triggerEvent(Event event, TaskBatch* batch = nullptr);
         };
 
-        int epfd_ = 0;
-        int tickleFds_[2];
+        // 取完监听 socket 上积压的连接, 分给各个工作线程
+        void acceptAll(const std::shared_ptr<Listener>& listener, TaskBatch& batch);
+        // 持有 fd_ctx->mutex 时调用, 从所有 reactor 上注销并等正在进行的 accept4 结束
+        void removeListener(FdContext* fd_ctx);
+
+        // EPOLL_PERSISTENT 下的 addEvent(), 已经持有 fd_ctx->mutex
+        int addPersistentEvent(FdContext* fd_ctx, Event event, Callback cb);
+        // 登记等待者: cb 为空时等待的是当前协程
+        void addWaiter(FdContext* fd_ctx, Event event, Callback& cb);
+        void triggerPersistentEvent(FdContext* fd_ctx, uint32_t events, TaskBatch& batch);
+
+        // 等待 waitIo() 完成, 协程栈上的对象, user_data 指向它
+        struct IoRequest {
+            std::shared_ptr<Fiber> fiber;
+            int res = 0;
+            __kernel_timespec timeout;
+            // 提交到哪个工作线程的 ring
+            int ring = -1;
+            // 以下由 fd 的 FdContext::mutex 保护
+            // 已经对它提交过 ASYNC_CANCEL
+            bool closing = false;
+            IoRequest* prev = nullptr;
+            IoRequest* next = nullptr;
+        };
+
+        // 一个 epoll 实例和它的唤醒 eventfd; 默认所有工作线程共用一个, sharded 时每个工作线程一个
+        struct Reactor {
+            int epfd = -1;
+            int tickleFd = -1;
+            // 已经写进 eventfd 但还没有线程取走的唤醒数
+            std::atomic<int> pendingWakeups = {0};
+            // 正阻塞在这个 epoll 上的线程数, 为 0 时 tickle 不做系统调用
+            std::atomic<int> waiters = {0};
+        };
+
+        // 工作线程的 ring, 它的 reactor 的 epfd 也挂在上面(poll), 所以 idle 只需要在 ring 上等待
+        struct WorkerRing {
+            Reactor* reactor = nullptr;
+            std::unique_ptr<IoUring> ring;
+            // 上一次 epoll_wait 取满了, epfd 上可能还有事件, 但不会再有新的 poll 通知
+            bool epollBacklog = false;
+            // waitIo() 交出还没完成的请求数, 只有所属线程访问
+            size_t inflight = 0;
+        };
+
+        // 等待事件, 超时为微秒; 内核支持时用 epoll_pwait2, 否则退回毫秒精度的 epoll_wait(向上取整)
+        int waitEvents(int epfd, epoll_event* events, int max_events, uint64_t timeout_us);
+        // URING 后端的等待: 完成的请求放进 batch, reactor 的 epfd 可读时取出就绪事件, 返回事件数
+        int waitRing(WorkerRing& wr, epoll_event* events, int max_events, uint64_t timeout_us, TaskBatch& batch);
+        void armEpollPoll(WorkerRing& wr);
+        // 在 index 号 ring 的线程上调用, 取消这个 ring 上等 fd_ctx 的请求
+        void cancelOnRing(FdContext* fd_ctx, size_t index);
+
+        // fd 还没绑定时绑定到一个 reactor, 返回它
+        Reactor& bindReactor(FdContext* fd_ctx);
+        // 轮流选一个 reactor, 给不在工作线程上注册的 fd 和 sharded 时新接受的连接
+        int nextReactor();
+        // 有线程阻塞在 reactor 上并且还没被唤醒时写 eventfd, 返回是否写了
+        bool wakeReactor(Reactor& reactor);
+
+        std::vector<std::unique_ptr<Reactor>> reactors_;
+        // 不在工作线程上注册的 fd 轮流分配, tickle() 也从这里轮流找
+        std::atomic<size_t> nextReactor_ = {0};
         std::atomic<size_t> pendingEventCount_ = 0;
-        std::shared_mutex mutex_;
-        std::vector<FdContext*> fdContexts_;
+        bool persistent_ = false;
+        bool sharded_ = false;
+        // FdContext 较大, 每页 256 个
+        FdTable<FdContext, 8> fdContexts_;
+
+        // URING 后端每个工作线程一个, EPOLL 后端为空
+        std::vector<std::unique_ptr<WorkerRing>> rings_;
+        // 内核不支持 multishot poll 时每次触发后重新挂上
+        std::atomic<bool> multishotPoll_ = {true};
 
     protected:
         void tickle() override;
+        void tickleWorker(size_t index) override;
         bool stopping() override;
         void idle() override;
         void onTimerInsertedAtFront() override;
-        void contextResize(size_t size);
+        int currentTimerShard() override {return currentWorker();}
 
     };
 
@@ -0,0 +1,393 @@
+// 断言里有要执行的调用, 总是打开
+#undef NDEBUG
+#include "ioscheduler.h"
+#include "../hook/hook.h"
+#include "../fd_manager/fd_manager.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+using namespace mushanyu;
+
+// 各种 IoBackend 和 sharded 组合下被 hook 的阻塞 IO、fd 复用和监听 socket
+
+struct Mode {
+    const char* name;
+    IOManager::IoBackend backend;
+    bool sharded;
+    // 主线程也是 0 号工作线程, 但只在 stop() 里运行调度, 不能有任务或 fd 分给它
+    bool use_caller;
+};
+
+// hook 开关是线程局部的, 协程睡醒后可能换到别的工作线程上, 所以每个工作线程都要打开:
+// 每个任务占住一个线程直到 threads 个都开始运行, 保证每个线程各跑一个
+static void enableHook(IOManager& iom, int threads) {
+    std::atomic<int> arrived{0};
+    std::atomic<int> left{threads};
+    for (int i = 0; i < threads; i++) {
+        iom.scheduleLock([&]() {
+            set_hook_enable(true);
+            arrived++;
+            while (arrived < threads) {
+                usleep_f(100);
+            }
+            left--;
+        });
+    }
+    while (left > 0) {
+        usleep(1000);
+    }
+}
+
+// 在 iom 上运行 cb, 等它结束
+static void runOn(IOManager& iom, std::function<void()> cb) {
+    std::atomic<bool> done{false};
+    iom.scheduleLock([&]() {
+        cb();
+        done = true;
+    });
+    while (!done) {
+        usleep(1000);
+    }
+}
+
+static void setRecvTimeout(int fd, int ms) {
+    timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    assert(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+}
+
+// 一来一回 kRounds 次, 读端带超时: 每次等待都挂上再取消超时定时器
+static void testPingPong(IOManager& iom) {
+    const int kRounds = 2000;
+    runOn(iom, [&]() {
+        int sv[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        FdMgr::GetInstance()->get(sv[0], true);
+        FdMgr::GetInstance()->get(sv[1], true);
+        setRecvTimeout(sv[0], 1000);
+        std::atomic<int> echoed{0};
+        std::atomic<bool> echo_done{false};
+        iom.scheduleLock([&, fd = sv[1]]() {
+            char c;
+            while (recv(fd, &c, 1, 0) == 1) {
+                echoed++;
+                assert(send(fd, &c, 1, 0) == 1);
+            }
+            echo_done = true;
+        });
+        for (int i = 0; i < kRounds; i++) {
+            char c = 'a' + i % 26;
+            char back = 0;
+            assert(send(sv[0], &c, 1, 0) == 1);
+            assert(recv(sv[0], &back, 1, 0) == 1);
+            assert(back == c);
+        }
+        assert(echoed == kRounds);
+        // 对端读到 EOF 退出
+        close(sv[0]);
+        while (!echo_done) {
+            usleep(1000);
+        }
+        close(sv[1]);
+    });
+}
+
+// SO_RCVTIMEO 到期返回 ETIMEDOUT, 不能提前
+static void testTimeout(IOManager& iom) {
+    runOn(iom, [&]() {
+        int sv[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        FdMgr::GetInstance()->get(sv[0], true);
+        setRecvTimeout(sv[0], 30);
+        char buf[16];
+        auto start = std::chrono::steady_clock::now();
+        ssize_t n = recv(sv[0], buf, sizeof(buf), 0);
+        int err = errno;
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        assert(n == -1 && err == ETIMEDOUT);
+        assert(ms >= 29 && ms < 1000);
+        close(sv[0]);
+        close(sv[1]);
+    });
+}
+
+// 两个协程同时阻塞读同一个 fd: 后来的不能改掉或者取消先来的超时, 两个都要按时返回
+static void testSharedWait(IOManager& iom) {
+    runOn(iom, [&]() {
+        int sv[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        FdMgr::GetInstance()->get(sv[0], true);
+        setRecvTimeout(sv[0], 50);
+        std::atomic<int> done{0};
+        std::atomic<int> timed_out{0};
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 2; i++) {
+            iom.scheduleLock([&]() {
+                char c;
+                ssize_t n = recv(sv[0], &c, 1, 0);
+                assert(n == -1);
+                if (errno == ETIMEDOUT) {
+                    timed_out++;
+                }
+                done++;
+            });
+            // 第一个先挂起
+            usleep(10000);
+        }
+        while (done < 2) {
+            usleep(1000);
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        // 同一个方向只能登记一个等待者, 第二个可能直接失败, 但第一个一定是超时返回
+        assert(timed_out >= 1);
+        assert(ms >= 49 && ms < 1000);
+        close(sv[0]);
+        close(sv[1]);
+    });
+}
+
+// 在不属于任何调度器的线程上给已经可读的 fd 加回调: 常驻注册时就绪状态已经缓存, 回调要直接调度到 iom 上
+static void testForeignAddEvent(IOManager& iom) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    std::atomic<int> fired{0};
+    // 第一次等待完成注册
+    assert(iom.addEvent(sv[0], IOManager::WRITE, [&]() {fired++;}) == 0);
+    while (fired < 1) {
+        usleep(1000);
+    }
+    // 没有人等的时候变成可读
+    assert(write(sv[1], "x", 1) == 1);
+    usleep(20000);
+    // 构造 iom 的主线程也算它的线程, 换一个线程
+    std::thread foreign([&]() {
+        assert(iom.addEvent(sv[0], IOManager::READ, [&]() {fired++;}) == 0);
+    });
+    foreign.join();
+    while (fired < 2) {
+        usleep(1000);
+    }
+    iom.cancelAll(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// 关闭一个有协程阻塞在上面的 fd, 阻塞的协程要被唤醒, 否则 stop() 等不到它
+static void testCloseWakeup(IOManager& iom) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(listener, 16) == 0);
+
+    std::atomic<int> woken{0};
+    runOn(iom, [&]() {
+        FdMgr::GetInstance()->get(sv[0], true);
+        FdMgr::GetInstance()->get(listener, true);
+        iom.scheduleLock([&]() {
+            char buf[16];
+            ssize_t n = recv(sv[0], buf, sizeof(buf), 0);
+            assert(n <= 0);
+            woken++;
+        });
+        iom.scheduleLock([&]() {
+            int fd = accept(listener, nullptr, nullptr);
+            assert(fd < 0);
+            woken++;
+        });
+        // 让两个协程先挂起
+        usleep(20000);
+        close(sv[0]);
+        close(listener);
+    });
+    while (woken < 2) {
+        usleep(1000);
+    }
+    close(sv[1]);
+}
+
+// 关闭 fd 只叫醒在这个 fd 上等待的协程, 不能 shutdown 掉 socket 本身: dup 出来的 fd 照常收发
+static void testCloseDup(IOManager& iom) {
+    runOn(iom, [&]() {
+        int sv[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        FdMgr::GetInstance()->get(sv[0], true);
+        int copy = dup(sv[0]);
+        assert(copy >= 0);
+        FdMgr::GetInstance()->get(copy, true);
+        std::atomic<bool> woken{false};
+        iom.scheduleLock([&]() {
+            char c;
+            assert(recv(sv[0], &c, 1, 0) == -1);
+            woken = true;
+        });
+        usleep(20000);
+        close(sv[0]);
+        while (!woken) {
+            usleep(1000);
+        }
+        char c = 0;
+        assert(send(sv[1], "y", 1, 0) == 1);
+        assert(recv(copy, &c, 1, 0) == 1 && c == 'y');
+        assert(send(copy, "z", 1, 0) == 1);
+        assert(recv(sv[1], &c, 1, 0) == 1 && c == 'z');
+        close(copy);
+        close(sv[1]);
+    });
+}
+
+// 关闭后同一个 fd 号被新 socket 复用: 拿到的是重置过的 FdCtx, 上一次等待的超时定时器也不能落到新的等待上
+static void testFdReuse(IOManager& iom) {
+    runOn(iom, [&]() {
+        int sv[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        FdCtx* old_ctx = FdMgr::GetInstance()->get(sv[0], true);
+        setRecvTimeout(sv[0], 20);
+        char c;
+        assert(recv(sv[0], &c, 1, 0) == -1 && errno == ETIMEDOUT);
+        int old = sv[0];
+        uint32_t generation = old_ctx->generation();
+        close(sv[0]);
+        close(sv[1]);
+        // 还拿着旧指针的一方能看出 fd 已经关闭
+        assert(old_ctx->isClosed() && old_ctx->generation() != generation);
+        assert(!FdMgr::GetInstance()->get(old));
+
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        assert(sv[0] == old);
+        FdCtx* ctx = FdMgr::GetInstance()->get(sv[0], true);
+        assert(ctx == old_ctx && ctx->isSocket() && !ctx->isClosed());
+        assert(ctx->generation() != generation);
+        assert(ctx->getTimeout(SO_RCVTIMEO) == (uint64_t)-1);
+        iom.scheduleLock([fd = sv[1]]() {
+            usleep(50000);
+            assert(send(fd, "x", 1, 0) == 1);
+        });
+        assert(recv(sv[0], &c, 1, 0) == 1 && c == 'x');
+        close(sv[0]);
+        close(sv[1]);
+    });
+}
+
+// addListener 之后的连接都交给 handler; delListener 之后不再接受, 重复注销返回 false
+static void testListener(IOManager& iom) {
+    const int kClients = 50;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    assert(bind(listener, (sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(listener, 128) == 0);
+    assert(getsockname(listener, (sockaddr*)&addr, &len) == 0);
+
+    std::atomic<int> accepted{0};
+    assert(iom.addListener(listener, [&](int fd) {
+        accepted++;
+        ::close(fd);
+    }));
+    assert(!iom.addListener(listener, [](int fd) {::close(fd);}));
+
+    // 主线程没有开 hook, 这里是普通的阻塞调用
+    for (int i = 0; i < kClients; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+        close(fd);
+    }
+    for (int i = 0; i < 5000 && accepted < kClients; i++) {
+        usleep(1000);
+    }
+    assert(accepted == kClients);
+
+    assert(iom.delListener(listener));
+    assert(!iom.delListener(listener));
+    // 内核仍然会完成握手, 但不会再有人取走
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+    usleep(20000);
+    assert(accepted == kClients);
+    close(fd);
+    close(listener);
+}
+
+// 所有工作线程都睡在 reactor 上时从外部提交一批任务, 每个任务占住所在线程直到整批都开始运行:
+// 一次批量提交要叫醒和任务数一样多的线程, 不能只叫醒一个
+static void testBatchSpread(const Mode& mode) {
+    const int kThreads = 4;
+    IOManager iom(kThreads, false, mode.name, TimerManager::TREE, 1, mode.backend, mode.sharded);
+    for (int round = 0; round < 20; round++) {
+        // 让工作线程都进入 idle
+        usleep(5000);
+        std::atomic<int> started{0};
+        std::atomic<int> finished{0};
+        std::atomic<bool> spread{true};
+        std::vector<Callback> cbs;
+        for (int i = 0; i < kThreads; i++) {
+            cbs.emplace_back([&]() {
+                started++;
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                while (started < kThreads) {
+                    if (std::chrono::steady_clock::now() > deadline) {
+                        spread = false;
+                        break;
+                    }
+                    usleep(100);
+                }
+                finished++;
+            });
+        }
+        iom.scheduleBatch(cbs.begin(), cbs.end());
+        while (finished < kThreads) {
+            usleep(1000);
+        }
+        assert(spread);
+    }
+}
+
+int main() {
+    // 唤醒不了时 stop() 会一直等, 不要让测试卡住
+    alarm(60);
+    const Mode modes[] = {
+        {"EPOLL", IOManager::EPOLL, false, false},
+        {"EPOLL_PERSISTENT", IOManager::EPOLL_PERSISTENT, false, false},
+        {"URING", IOManager::URING, false, false},
+        {"EPOLL sharded", IOManager::EPOLL, true, false},
+        {"EPOLL_PERSISTENT sharded", IOManager::EPOLL_PERSISTENT, true, false},
+        {"URING sharded", IOManager::URING, true, false},
+        {"EPOLL sharded use_caller", IOManager::EPOLL, true, true},
+        {"URING sharded use_caller", IOManager::URING, true, true},
+    };
+    // 每种模式一个新的 IOManager, fd 上下文和它们的定时器节点跨 IOManager 复用
+    for (const Mode& mode : modes) {
+        {
+            int threads = mode.sharded ? 2 : 1;
+            IOManager iom(threads + (mode.use_caller ? 1 : 0), mode.use_caller, mode.name, TimerManager::TREE, 1, mode.backend, mode.sharded);
+            enableHook(iom, threads);
+            testPingPong(iom);
+            testTimeout(iom);
+            testSharedWait(iom);
+            testForeignAddEvent(iom);
+            testCloseWakeup(iom);
+            testCloseDup(iom);
+            testFdReuse(iom);
+            testListener(iom);
+        }
+        testBatchSpread(mode);
+        std::cout << mode.name << " ok" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include "runtime.h"
+#include "../hook/hook.h"
+#include "../fd_manager/fd_manager.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+namespace mushanyu {
+    // 当前线程所属的运行时和 shard 编号
+    static thread_local Runtime* t_runtime = nullptr;
+    static thread_local int t_shard = -1;
+
+    // 当前进程允许运行的 CPU
+    static std::vector<int> AvailableCpus() {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int i = 0; i < CPU_SETSIZE; ++i) {
+                if (CPU_ISSET(i, &set)) {
+                    cpus.push_back(i);
+                }
+            }
+        }
+        if (cpus.empty()) {
+            for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); ++i) {
+                cpus.push_back(i);
+            }
+        }
+        return cpus;
+    }
+
+    Runtime::Runtime(size_t shards, bool pin, const std::string& name, IOManager::IoBackend io_backend) {
+        std::vector<int> cpus = AvailableCpus();
+        if (shards == 0) {
+            shards = cpus.size();
+        }
+        for (size_t i = 0; i < shards; ++i) {
+            std::unique_ptr<Shard> shard(new Shard);
+            // 不绑定到构造线程, 一个线程可以构造多个 shard
+            shard->iom.reset(new IOManager(1, false, name + "_" + std::to_string(i), TimerManager::TREE, 1,
+                                           io_backend, false, false));
+            shard->cpu = pin ? cpus[i % cpus.size()] : -1;
+            shards_.push_back(std::move(shard));
+        }
+        // shards_ 不再变化之后再投递; 之后 post() 的任务排在它后面, 同一个线程按顺序取全局队列
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->iom->scheduleLock([this, i]() {
+                enter(i);
+            });
+        }
+    }
+
+    Runtime::~Runtime() {
+        stop();
+    }
+
+    void Runtime::enter(size_t index) {
+        if (t_runtime == this) {
+            return;
+        }
+        t_runtime = this;
+        t_shard = index;
+        // 每个 shard 只有一个线程, 协程不会换线程, 在这里开一次 hook 就够了
+        set_hook_enable(true);
+        if (shards_[index]->cpu >= 0) {
+            Thread::SetAffinity(shards_[index]->cpu);
+        }
+    }
+
+    int Runtime::currentShard() const {
+        return t_runtime == this ? t_shard : -1;
+    }
+
+    void Runtime::post(size_t index, Callback cb) {
+        shards_[index]->iom->scheduleLock(std::move(cb));
+    }
+
+    bool Runtime::listen(const sockaddr* addr, socklen_t addrlen, Handler handler, int backlog) {
+        std::vector<int> fds;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            if (fd < 0
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+                || bind(fd, addr, addrlen)
+                || ::listen(fd, backlog)) {
+                std::cerr << "Runtime::listen failed: " << strerror(errno) << std::endl;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                for (int opened : fds) {
+                    close(opened);
+                }
+                return false;
+            }
+            fds.push_back(fd);
+        }
+
+        std::shared_ptr<Handler> shared(new Handler(std::move(handler)));
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            // 每个 shard 有自己的监听 socket, 积压的连接由 IOManager 一次取完, 都留在本 shard 上处理
+            bool ok = shards_[i]->iom->addListener(fds[i], [this, i, shared](int fd) {
+                // 接受的连接放进 shard 线程自己的队列, 可能先于构造时投递的 enter() 运行
+                enter(i);
+                // 登记后被 hook 的 IO 在 fd 没就绪时让出协程
+                FdMgr::GetInstance()->get(fd, true);
+                (*shared)(fd);
+            });
+            if (!ok) {
+                for (size_t j = 0; j < fds.size(); ++j) {
+                    if (j < i) {
+                        shards_[j]->iom->delListener(fds[j]);
+                    }
+                    close(fds[j]);
+                }
+                return false;
+            }
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->listeners.push_back(fds[i]);
+        }
+        return true;
+    }
+
+    void Runtime::stop() {
+        if (stopped_) {
+            return;
+        }
+        stopped_ = true;
+        for (auto& shard : shards_) {
+            for (int fd : shard->listeners) {
+                shard->iom->delListener(fd);
+                close(fd);
+            }
+            shard->listeners.clear();
+        }
+        // 析构时 stop(), 等各自的任务都结束
+        for (auto& shard : shards_) {
+            shard->iom.reset();
+        }
+    }
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../ioscheduler/ioscheduler.h"
+
+#include <sys/socket.h>
+
+namespace mushanyu {
+/***
+ * @description: thread-per-core 运行时
+ * 启动 N 个互相独立的单线程 IOManager(shard), 每个绑在一个 CPU 上, 定时器、fd 上下文、任务队列都是各自一份.
+ * listen() 在每个 shard 上各开一个 SO_REUSEPORT 监听 socket, 由内核把新连接分给各个 shard,
+ * 一个连接从 accept 到关闭都在同一个线程上处理, 热路径上不共享任何东西.
+ * 偶尔需要跨 shard 的任务用 post() 投递到目标 shard 的无锁任务队列.
+ * shard 线程上默认开启 hook.
+ */
+class Runtime {
+public:
+    // 连接处理函数, 在接受连接的 shard 上的新协程里运行, 由它负责关闭 fd
+    using Handler = BasicCallback<int>;
+
+    // shards 为 0 时取可用 CPU 数; pin 时第 i 个 shard 绑到第 i 个可用 CPU 上
+    Runtime(size_t shards = 0, bool pin = true, const std::string& name = "Runtime",
+            IOManager::IoBackend io_backend = IOManager::EPOLL);
+    ~Runtime();
+
+    Runtime(const Runtime&) = delete;
+    Runtime& operator=(const Runtime&) = delete;
+
+    size_t shardCount() const {return shards_.size();}
+    IOManager* shard(size_t index) {return shards_[index]->iom.get();}
+    // 当前线程是本运行时的第几个 shard, 不是时返回 -1
+    int currentShard() const;
+
+    // 把任务投递到 index 号 shard 上运行
+    void post(size_t index, Callback cb);
+
+    // 每个 shard 各监听一个绑定到 addr 的 SO_REUSEPORT socket, 接受的连接交给 handler;
+    // 任何一个失败时关闭已经打开的 socket 并返回 false
+    bool listen(const sockaddr* addr, socklen_t addrlen, Handler handler, int backlog = 1024);
+
+    // 注销并关闭所有监听 socket, 停止所有 shard, 等已经接受的连接处理完
+    void stop();
+
+private:
+    struct Shard {
+        std::unique_ptr<IOManager> iom;
+        std::vector<int> listeners;
+        // 绑定的 CPU, 不绑定时为 -1
+        int cpu = -1;
+    };
+
+    // 在 index 号 shard 的线程上调用, 第一次调用时登记线程所属的 shard、开启 hook、绑定 CPU
+    void enter(size_t index);
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    bool stopped_ = false;
+};
+
+}
@@ -0,0 +1,107 @@
+// 断言里有要执行的调用, 总是打开
+#undef NDEBUG
+#include "runtime.h"
+#include "../hook/hook.h"
+#include <iostream>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstring>
+#include <cassert>
+
+using namespace mushanyu;
+
+const int kConnections = 200;
+const int kPosts = 100;
+
+// 每个 shard 收到 kPosts 个任务, 每个任务在自己的 shard 上运行、开着 hook, 再转投给下一个 shard
+static void testPost(Runtime& runtime) {
+    size_t n = runtime.shardCount();
+    std::vector<std::atomic<int>> ran(n);
+    std::vector<std::atomic<int>> relayed(n);
+    std::atomic<bool> ok{true};
+    for (size_t i = 0; i < n; i++) {
+        for (int j = 0; j < kPosts; j++) {
+            runtime.post(i, [&, i]() {
+                if (runtime.currentShard() != (int)i || !is_hook_enable()) {
+                    ok = false;
+                }
+                ran[i]++;
+                size_t next = (i + 1) % n;
+                runtime.post(next, [&, next]() {
+                    if (runtime.currentShard() != (int)next) {
+                        ok = false;
+                    }
+                    relayed[next]++;
+                });
+            });
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        while (ran[i] < kPosts || relayed[i] < kPosts) {
+            usleep(1000);
+        }
+    }
+    assert(ok);
+}
+
+int main() {
+    Runtime runtime(4);
+    std::atomic<int> per_shard[4] = {};
+    // shard 的调度器不绑定到构造它的线程
+    assert(Scheduler::GetThis() == nullptr);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    // 各个 shard 的 SO_REUSEPORT socket 要绑到同一个端口上: 先用一个同样设置的 socket 绑端口 0,
+    // 读回内核分配的端口; 它不 listen, 不会分到连接, 一直占着端口直到 shard 都绑好
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    socklen_t len = sizeof(addr);
+    assert(setsockopt(probe, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0);
+    assert(setsockopt(probe, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0);
+    assert(bind(probe, (sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(getsockname(probe, (sockaddr*)&addr, &len) == 0);
+
+    // 每个连接回一个字节, 记录它落在哪个 shard 上
+    bool ok = runtime.listen((sockaddr*)&addr, sizeof(addr), [&](int fd) {
+        per_shard[runtime.currentShard()]++;
+        char buf[16];
+        if (recv(fd, buf, sizeof(buf), 0) > 0) {
+            send(fd, "x", 1, 0);
+        }
+        close(fd);
+    });
+    close(probe);
+    assert(ok);
+
+    // 主线程没有开 hook, 这里是普通的阻塞调用
+    for (int i = 0; i < kConnections; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+        char c;
+        assert(send(fd, "ping", 4, 0) == 4);
+        assert(recv(fd, &c, 1, 0) == 1 && c == 'x');
+        close(fd);
+    }
+
+    // 客户端收到回复时 handler 已经计过数
+    int total = 0;
+    for (int i = 0; i < 4; i++) {
+        std::cout << "shard " << i << " accepted " << per_shard[i] << " connections" << std::endl;
+        total += per_shard[i];
+    }
+    assert(total == kConnections);
+
+    testPost(runtime);
+    // 不属于运行时的线程
+    assert(runtime.currentShard() == -1);
+
+    runtime.stop();
+    std::cout << "runtime stopped" << std::endl;
+    return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mushanyu {
+/***
+ * @description: 基于 futex 的 eventcount, 用来让空闲线程休眠而不丢失唤醒
+ * 等待方: key = prepareWait(); 再检查一次条件; 条件满足就 cancelWait(), 否则 wait(key).
+ * 通知方: 先让条件成立(比如任务入队), 再 notify().
+ * prepareWait 和 notify 之间靠 seq_cst 栅栏配对, 通知方要么看到等待者, 要么等待方能看到条件成立.
+ */
+class EventCount {
+public:
+    uint32_t prepareWait() {
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch_.load(std::memory_order_acquire);
+    }
+
+    void cancelWait() {
+        waiters_.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void wait(uint32_t key) {
+        while (epoch_.load(std::memory_order_acquire) == key) {
+            syscall(SYS_futex, &epoch_, FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+        }
+        waiters_.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    // 有等待者时唤醒一个, 没有等待者时只是一次原子读
+    void notify() {
+        wake(1);
+    }
+
+    void notifyAll() {
+        wake(INT_MAX);
+    }
+
+    bool hasWaiters() const {
+        return waiters_.load(std::memory_order_acquire) != 0;
+    }
+
+private:
+    void wake(int n) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        epoch_.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, &epoch_, FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+    }
+
+    // futex 只能等 32 位的字
+    alignas(64) std::atomic<uint32_t> epoch_{0};
+    std::atomic<uint32_t> waiters_{0};
+};
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace mushanyu {
+/***
+ * @description: 多生产者多消费者队列
+ * 主体是无锁的有界环形缓冲区(每个槽位带序号, Vyukov 算法), 生产者之间、消费者之间只在各自的位置计数上 CAS;
+ * 环形缓冲区写满时才退化到加锁的溢出队列, 因此整体是无界的. 溢出后不保证严格的先进先出.
+ * T 一般是指针.
+ */
+template <class T>
+class MpmcQueue {
+public:
+    // capacity 必须是 2 的幂
+    explicit MpmcQueue(size_t capacity = 1024) : mask_(capacity - 1), cells_(new Cell[capacity]) {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    void push(T item) {
+        if (tryPush(item)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(overflowMutex_);
+        overflow_.push_back(item);
+        overflowSize_.fetch_add(1, std::memory_order_release);
+    }
+
+    // 批量放入, 环形缓冲区空位足够时只做一次 CAS
+    void push(const T* items, size_t n) {
+        if (n == 0) {
+            return;
+        }
+        if (n <= mask_ + 1) {
+            size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+            while (hasRoom(pos, n)) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+                    for (size_t i = 0; i < n; ++i) {
+                        Cell* cell = &cells_[(pos + i) & mask_];
+                        cell->data = items[i];
+                        cell->seq.store(pos + i + 1, std::memory_order_release);
+                    }
+                    return;
+                }
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            push(items[i]);
+        }
+    }
+
+    bool pop(T& item) {
+        if (tryPop(item)) {
+            return true;
+        }
+        if (overflowSize_.load(std::memory_order_acquire) == 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(overflowMutex_);
+        if (overflow_.empty()) {
+            return false;
+        }
+        item = overflow_.front();
+        overflow_.pop_front();
+        overflowSize_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 近似值, 并发修改时只作参考
+    bool empty() const {
+        return enqueuePos_.load(std::memory_order_acquire) == dequeuePos_.load(std::memory_order_acquire)
+            && overflowSize_.load(std::memory_order_acquire) == 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    // [pos, pos + n) 的槽位是否都已被消费者腾出
+    bool hasRoom(size_t pos, size_t n) const {
+        for (size_t i = 0; i < n; ++i) {
+            if (cells_[(pos + i) & mask_].seq.load(std::memory_order_acquire) != pos + i) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool tryPush(T item) {
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = item;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& item) {
+        size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        item = cell->data;
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> enqueuePos_{0};
+    alignas(64) std::atomic<size_t> dequeuePos_{0};
+
+    alignas(64) std::atomic<size_t> overflowSize_{0};
+    std::mutex overflowMutex_;
+    std::deque<T> overflow_;
+};
+}
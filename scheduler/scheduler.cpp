@@ -1,10 +1,41 @@
 #include "scheduler.h"
+#include "../timer/clock.h"
+#include "../fiber/cpu_relax.h"
 
-static bool debug = false;
+#include <algorithm>
 
 namespace mushanyu {
 
+// 每个工作线程缓存的已结束协程数
+static const size_t kMaxFreeFibers = 64;
+// 每个线程缓存的空闲任务节点数
+static const size_t kMaxFreeTasks = 1024;
+// idle() 休眠前自旋检查任务的次数上下限, 最近自旋等到过任务就加倍, 否则减半
+static const int kMinIdleSpins = 16;
+static const int kMaxIdleSpins = 4096;
+
 static thread_local Scheduler* t_scheduler = nullptr;
+// 当前线程在所属调度器里的工作线程编号, 不是工作线程时为 -1
+static thread_local int t_worker_index = -1;
+// 当前线程正在执行 run() 的调度器, 使用调用线程时创建调度器的线程要到 stop() 里才进入 run()
+static thread_local Scheduler* t_running = nullptr;
+
+// 线程退出时释放缓存的节点
+template <class T>
+struct FreeList {
+	std::vector<T*> nodes;
+	~FreeList() {
+		for(T* node : nodes) {
+			delete node;
+		}
+	}
+};
+
+template <class T>
+static FreeList<T>& ThreadFreeList() {
+	static thread_local FreeList<T> list;
+	return list;
+}
 
 Scheduler* Scheduler::GetThis() {
 	return t_scheduler;
@@ -14,13 +45,15 @@ void Scheduler::SetThis() {
 	t_scheduler = this;
 }
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name):
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name, bool bind_thread):
 useCaller_(use_caller), name_(name) {
-	assert(threads > 0 && Scheduler::GetThis() == nullptr);
+	assert(threads > 0 && (bind_thread || !use_caller));
 
-	SetThis();
-
-	Thread::SetName(name_);
+	if(bind_thread) {
+		assert(Scheduler::GetThis() == nullptr);
+		SetThis();
+		Thread::SetName(name_);
+	}
 
 	if(use_caller) {
 		threads --;
@@ -32,9 +65,18 @@ useCaller_(use_caller), name_(name) {
 		
 		rootThread_ = Thread::GetThreadId();
 		threadIds_.push_back(rootThread_);
+		t_worker_index = 0;
+	} else if(bind_thread) {
+		t_worker_index = -1;
 	}
 
 	threadCount_ = threads;
+	for (size_t i = 0; i < threadCount_ + (use_caller ? 1 : 0); i ++) {
+		workers_.emplace_back(new Worker());
+	}
+	if(use_caller) {
+		workers_[0]->thread = rootThread_;
+	}
 	if(debug) std::cout << "Scheduler::Scheduler() success" << std::endl;
 }
 
@@ -56,8 +98,15 @@ void Scheduler::start() {
 	assert(threads_.empty());
 	threads_.resize(threadCount_);
 	for (size_t i = 0; i < threadCount_; i ++) {
-		threads_[i].reset(new Thread(std::bind(&Scheduler::run, this), name_ + "_" + std::to_string(i)));
+		// use_caller 时 0 号是创建调度器的线程
+		size_t index = i + (useCaller_ ? 1 : 0);
+		threads_[i].reset(new Thread([this, index]() {
+			t_worker_index = index;
+			run();
+		}, name_ + "_" + std::to_string(i)));
 		threadIds_.push_back(threads_[i]->getId());
+		// start() 返回时所有工作线程的 id 都已登记, 按编号投递任务或者绑定 fd 不会拿到 -1
+		workers_[index]->thread.store(threads_[i]->getId(), std::memory_order_release);
 	}
 	if(debug) std::cout << "Scheduler::start() success" << std::endl;
 }
@@ -68,69 +117,247 @@ void Scheduler::run() {
 	
 
 	SetThis();
+	t_running = this;
 
 	if(thread_id != rootThread_) {
 		Fiber::GetThis();
+		workers_[t_worker_index]->thread = thread_id;
 	}
 
 	std::shared_ptr<Fiber> idle_fiber = std::make_shared<Fiber>(std::bind(&Scheduler::idle, this));
 	ScheduleTask task;
+	// 已结束的回调协程, 通过 reset() 复用, 避免每个回调任务都分配协程和栈
+	std::vector<std::shared_ptr<Fiber>> free_fibers;
 	
 	while(true) {
 		task.reset();
 		bool tickle_me = false;
-        {
-			std::lock_guard<std::mutex> lock(mutex_);
-			auto it = tasks_.begin();
-			while(it != tasks_.end()) {
-				if(it->thread != -1&&it->thread != thread_id) {
-					it ++;
-					tickle_me = true;
-					continue;
-				}
-				assert(it->fiber || it->cb);
-				task = *it;
-				tasks_.erase(it); 
-				activeThreadCount_ ++;
-				break;
-			}	
-			tickle_me = tickle_me || (it != tasks_.end());
-		}
+		takeTask(task, thread_id, tickle_me);
 
 		if(tickle_me) {
 			tickle();
 		}
 
+		// 每个任务重新缓存一次定时器时钟
+		Clock::Invalidate();
+
 		if(task.fiber) {
-			{					
-				std::lock_guard<std::mutex> lock(task.fiber->mtx_);
-				if(task.fiber->getState() != Fiber::TERM) {
-					task.fiber->resume();	
-				}
+			if(task.fiber->getState() != Fiber::TERM) {
+				task.fiber->resume();	
 			}
 			activeThreadCount_ --;
 			task.reset();
+		} else if(task.cb && task.inlined) {
+			task.cb();
+			activeThreadCount_ --;
+			task.reset();
 		} else if(task.cb) {
-			std::shared_ptr<Fiber> cb_fiber = std::make_shared<Fiber>(task.cb);
-			{
-				std::lock_guard<std::mutex> lock(cb_fiber->mtx_);
-				cb_fiber->resume();			
+			std::shared_ptr<Fiber> cb_fiber;
+			if(!free_fibers.empty()) {
+				cb_fiber.swap(free_fibers.back());
+				free_fibers.pop_back();
+				cb_fiber->reset(std::move(task.cb));
+			} else {
+				cb_fiber = std::make_shared<Fiber>(std::move(task.cb));
+			}
+			cb_fiber->resume();
+			// 只有调度器持有的已结束协程才能复用, 其它地方还引用着的不能动
+			if(cb_fiber->getState() == Fiber::TERM && cb_fiber.use_count() == 1 && free_fibers.size() < kMaxFreeFibers) {
+				free_fibers.push_back(std::move(cb_fiber));
 			}
 			activeThreadCount_ --;
 			task.reset();	
 		} else {		
             if (idle_fiber->getState() == Fiber::TERM) {
             	if(debug) std::cout << "Schedule::run() ends in thread: " << thread_id << std::endl;
+                t_running = nullptr;
                 break;
             }
+			Worker& self = *workers_[t_worker_index];
+			self.idle = true;
 			idleThreadCount_ ++;
 			idle_fiber->resume();				
 			idleThreadCount_--;
+			self.idle = false;
 		}
 	}
 	
 }
 
+int Scheduler::currentWorker() const {
+	return t_running == this ? t_worker_index : -1;
+}
+
+Scheduler::ScheduleTask* Scheduler::NewTask(ScheduleTask&& task) {
+	std::vector<ScheduleTask*>& nodes = ThreadFreeList<ScheduleTask>().nodes;
+	if(nodes.empty()) {
+		return new ScheduleTask(std::move(task));
+	}
+	ScheduleTask* t = nodes.back();
+	nodes.pop_back();
+	*t = std::move(task);
+	return t;
+}
+
+void Scheduler::FreeTask(ScheduleTask* task) {
+	std::vector<ScheduleTask*>& nodes = ThreadFreeList<ScheduleTask>().nodes;
+	if(nodes.size() >= kMaxFreeTasks) {
+		delete task;
+		return;
+	}
+	task->reset();
+	nodes.push_back(task);
+}
+
+void Scheduler::scheduleTask(ScheduleTask&& task) {
+	// use_caller 时创建调度器的线程在 stop() 之前不取任务, 不往它的本地队列里放
+	int self = currentWorker();
+	bool need_tickle;
+	ScheduleTask* t = NewTask(std::move(task));
+	if(t->thread == -1 && self >= 0) {
+		WorkStealQueue<ScheduleTask*>& queue = workers_[self]->local;
+		need_tickle = queue.empty();
+		queue.push(t);
+	} else if(t->thread != -1 && postToSelf(t, self)) {
+		need_tickle = false;
+	} else if(t->thread != -1 && postToMailbox(t)) {
+		// postToMailbox() 已经唤醒了目标线程
+		need_tickle = false;
+	} else {
+		// 目标线程还没登记的任务也先放进全局队列, 由取到它的线程转交
+		need_tickle = tasks_.empty();
+		tasks_.push(t);
+	}
+	if(need_tickle) {
+		tickle();
+	}
+}
+
+void Scheduler::scheduleTasks(std::vector<ScheduleTask*>& tasks) {
+	int self = currentWorker();
+	// 没有指定线程的任务保持原有顺序挪到前面, 整段一次性入队
+	auto mid = std::stable_partition(tasks.begin(), tasks.end(), [](ScheduleTask* t) {
+		return t->thread == -1;
+	});
+	size_t n = mid - tasks.begin();
+	if(self >= 0) {
+		workers_[self]->local.push(tasks.data(), n);
+	} else {
+		tasks_.push(tasks.data(), n);
+	}
+	// 进了信箱的任务已经唤醒了各自的目标线程, 只为进了队列的任务唤醒空闲线程
+	size_t queued = n;
+	for(auto it = mid; it != tasks.end(); ++ it) {
+		if(postToSelf(*it, self) || postToMailbox(*it)) {
+			continue;
+		}
+		queued ++;
+		tasks_.push(*it);
+	}
+
+	if(queued == 0) {
+		return;
+	}
+	size_t wake = std::min(queued, (size_t)idleThreadCount_);
+	for(size_t i = 0; i < std::max(wake, (size_t)1); i ++) {
+		tickle();
+	}
+}
+
+bool Scheduler::postToSelf(ScheduleTask* task, int self) {
+	if(self < 0 || workers_[self]->thread.load(std::memory_order_relaxed) != task->thread) {
+		return false;
+	}
+	workers_[self]->mailbox.push(task);
+	return true;
+}
+
+bool Scheduler::postToMailbox(ScheduleTask* task) {
+	for(size_t i = 0; i < workers_.size(); i ++) {
+		if(workers_[i]->thread.load(std::memory_order_acquire) == task->thread) {
+			workers_[i]->mailbox.push(task);
+			tickleWorker(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+void Scheduler::tickleWorker(size_t index) {
+	workers_[index]->parker.notify();
+}
+
+bool Scheduler::takeTask(ScheduleTask& task, int thread_id, bool& tickle_me) {
+	// 先计入活跃线程再取任务, 避免 stopping() 看到队列已空而任务还没开始执行
+	activeThreadCount_ ++;
+
+	int self = t_worker_index;
+	ScheduleTask* t = nullptr;
+	if(self >= 0 && (workers_[self]->local.pop(t) || workers_[self]->mailbox.pop(t))) {
+		task = std::move(*t);
+		FreeTask(t);
+		// 本地还有任务时让空闲线程来窃取
+		tickle_me = hasIdleThreads() && !workers_[self]->local.empty();
+		return true;
+	}
+
+	// 全局队列里偶尔会有目标线程当时还没登记的任务, 转交给对应的信箱后继续取
+	bool requeued = false;
+	while(tasks_.pop(t)) {
+		if(t->thread != -1 && t->thread != thread_id) {
+			if(!postToMailbox(t)) {
+				tasks_.push(t);
+				tickle_me = true;
+				break;
+			}
+			requeued = true;
+			continue;
+		}
+		task = std::move(*t);
+		FreeTask(t);
+		tickle_me = requeued || !tasks_.empty();
+		return true;
+	}
+	tickle_me = tickle_me || requeued;
+
+	if(stealTask(task, self)) {
+		return true;
+	}
+
+	// 其它空闲线程的信箱里还有任务, 它可能还没被唤醒, 继续唤醒
+	for(size_t i = 0; i < workers_.size(); i ++) {
+		if((int)i != self && workers_[i]->idle && !workers_[i]->mailbox.empty()) {
+			tickle_me = true;
+			break;
+		}
+	}
+	activeThreadCount_ --;
+	return false;
+}
+
+bool Scheduler::stealTask(ScheduleTask& task, int self) {
+	static thread_local uint32_t t_seed = Thread::GetThreadId();
+	t_seed ^= t_seed << 13;
+	t_seed ^= t_seed >> 17;
+	t_seed ^= t_seed << 5;
+
+	size_t count = workers_.size();
+	size_t start = t_seed % count;
+	for(size_t i = 0; i < count; i ++) {
+		size_t victim = (start + i) % count;
+		if((int)victim == self) {
+			continue;
+		}
+		ScheduleTask* stolen = nullptr;
+		if(workers_[victim]->local.steal(stolen)) {
+			task = std::move(*stolen);
+			FreeTask(stolen);
+			return true;
+		}
+	}
+	return false;
+}
+
 void Scheduler::stop()
 {
 	if(debug) std::cout << "Schedule::stop() starts in thread: " << Thread::GetThreadId() << std::endl;
@@ -144,7 +371,8 @@ void Scheduler::stop()
     if (useCaller_) {
         assert(GetThis() == this);
     } else {
-        assert(GetThis() != this);
+        // 创建调度器的线程也会 SetThis(), 只要求不在工作线程里调用
+        assert(GetThis() != this || t_worker_index == -1);
     }
 	
 	for (size_t i = 0; i < threadCount_; i++) {
@@ -172,20 +400,78 @@ void Scheduler::stop()
 	if(debug) std::cout << "Schedule::stop() ends in thread:" << Thread::GetThreadId() << std::endl;
 }
 
+// 唤醒一个在 idle() 里休眠的线程, 没有休眠的线程时什么都不做
 void Scheduler::tickle() {
+	// 和 EventCount::prepareWait() 配对, 保证入队的任务和等待者至少有一方被对方看到
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	size_t count = workers_.size();
+	size_t start = nextTickle_ ++;
+	for(size_t i = 0; i < count; i ++) {
+		Worker& worker = *workers_[(start + i) % count];
+		if(worker.parker.hasWaiters()) {
+			worker.parker.notify();
+			return;
+		}
+	}
 }
 
+// 先自旋等待一会儿, 还没有任务再在 futex 上休眠, 由 tickle() 唤醒
 void Scheduler::idle() {
+	EventCount& parker = workers_[t_worker_index]->parker;
+	int spins = kMinIdleSpins;
 	while(!stopping()) {
-		if(debug) std::cout << "Scheduler::idle(), sleeping in thread: " << Thread::GetThreadId() << std::endl;	
-		sleep(1);	
+		bool found = false;
+		for(int i = 0; i < spins; i ++) {
+			if(hasPendingTasks()) {
+				found = true;
+				break;
+			}
+			CpuRelax();
+		}
+		if(found) {
+			spins = std::min(spins * 2, kMaxIdleSpins);
+		} else {
+			spins = std::max(spins / 2, kMinIdleSpins);
+			uint32_t key = parker.prepareWait();
+			if(hasPendingTasks() || stopping()) {
+				parker.cancelWait();
+			} else {
+				if(debug) std::cout << "Scheduler::idle(), parking in thread: " << Thread::GetThreadId() << std::endl;
+				parker.wait(key);
+			}
+		}
 		Fiber::GetThis()->yield();
 	}
+	// 其它线程可能在最后一个任务结束前就已休眠, 叫醒它们各自检查退出
+	for(auto& worker : workers_) {
+		worker->parker.notifyAll();
+	}
+}
+
+bool Scheduler::hasPendingTasks() {
+	if(!tasks_.empty()) {
+		return true;
+	}
+	int self = t_worker_index;
+	for(size_t i = 0; i < workers_.size(); i ++) {
+		if(!workers_[i]->local.empty() || ((int)i == self && !workers_[i]->mailbox.empty())) {
+			return true;
+		}
+	}
+	return false;
 }
 
 bool Scheduler::stopping()  {
     std::lock_guard<std::mutex> lock(mutex_);
-    return stopping_ && tasks_.empty() && activeThreadCount_ == 0;
+    if(!stopping_ || !tasks_.empty() || activeThreadCount_ != 0) {
+        return false;
+    }
+    for(auto& worker : workers_) {
+        if(!worker->local.empty() || !worker->mailbox.empty()) {
+            return false;
+        }
+    }
+    return true;
 }
 
 
@@ -2,6 +2,9 @@
 
 #include "../fiber/fiber.h"
 #include "../thread/thread.h"
+#include "work_steal_queue.h"
+#include "mpmc_queue.h"
+#include "event_count.h"
 
 #include <mutex>
 #include <vector>
@@ -9,25 +12,48 @@
 namespace mushanyu {
 class Scheduler {
 public:
-    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "Scheduler");
+    // bind_thread 为 false 时不成为构造线程的当前调度器, 也不改它的线程名, 可以在已经有调度器的线程上构造;
+    // use_caller 时必须为 true
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "Scheduler", bool bind_thread = true);
     virtual ~Scheduler();
     const std::string& getName() const {return name_;}
     
     static Scheduler* GetThis();
 
+    // 工作线程自己产生的任务放进本线程的队列, 指定了线程的任务放进目标线程的信箱, 其它放进全局队列
     template <class FiberOrCb>
-    void scheduleLock(FiberOrCb fc, int thread = -1) {
-        bool need_tickle;
-        {
-            std::lock_guard(std::mutex) lock(mutex_);
-            need_tickle = tasks_.empty();
-            ScheduleTask task(fc, thread);
+    void scheduleLock(FiberOrCb&& fc, int thread = -1) {
+        ScheduleTask task(std::forward<FiberOrCb>(fc), thread);
+        if (task.fiber || task.cb) {
+            scheduleTask(std::move(task));
+        }
+    }
+
+    // cb 直接在调度协程上运行到结束, 不创建协程; cb 内部不允许 yield(包括被 hook 的阻塞调用)
+    void scheduleInline(Callback cb, int thread = -1) {
+        ScheduleTask task(&cb, thread);
+        task.inlined = true;
+        if (task.cb) {
+            scheduleTask(std::move(task));
+        }
+    }
+
+    // 批量提交协程或回调, 元素会被移走; 整批只做一次入队同步, 最多唤醒 min(任务数, 空闲线程数) 次.
+    // thread 不为 -1 时整批都指定在该线程上运行
+    template <class InputIterator>
+    void scheduleBatch(InputIterator begin, InputIterator end, int thread = -1) {
+        // 每个线程复用一个数组, 事件循环每一轮提交时不再分配
+        static thread_local std::vector<ScheduleTask*> tasks;
+        tasks.clear();
+        for (; begin != end; ++begin) {
+            ScheduleTask task(&*begin, thread);
             if (task.fiber || task.cb) {
-                tasks_.push_back(task);
+                tasks.push_back(NewTask(std::move(task)));
             }
         }
-        if (need_tickle) {
-            tickle();
+        if (!tasks.empty()) {
+            scheduleTasks(tasks);
+            tasks.clear();
         }
     }
 
@@ -43,15 +69,30 @@ protected:
 
     virtual void idle();
 
+    // 有任务投递到 index 号工作线程的信箱, 默认唤醒它在 idle() 里的休眠
+    virtual void tickleWorker(size_t index);
+
     virtual bool stopping();
 
     bool hasIdleThreads() {return idleThreadCount_ > 0;}
 
+    // 当前线程能取到的任务是否存在: 全局队列、自己的信箱、任意线程的本地队列
+    bool hasPendingTasks();
+
+    // 当前线程正在本调度器的 run() 里时返回它的工作线程编号, 否则返回 -1
+    int currentWorker() const;
+    size_t workerCount() const {return workers_.size();}
+    // index 号工作线程的线程 id, start() 之前为 -1
+    int workerThreadId(size_t index) const {return workers_[index]->thread.load(std::memory_order_acquire);}
+    // use_caller 时 0 号工作线程是创建调度器的线程, 它只在 stop() 里运行调度
+    bool callerIsWorker() const {return useCaller_;}
+
 private:
     struct ScheduleTask {
         std::shared_ptr<Fiber> fiber;
-        std::function<void()> cb;
+        Callback cb;
         int thread;
+        bool inlined = false;
 
         ScheduleTask() {
             fiber = nullptr;
@@ -59,22 +100,23 @@ private:
             thread = -1;
         }
 
+        // 共享栈协程只能回到绑定的线程上运行
         ScheduleTask(std::shared_ptr<Fiber> f, int thr) {
             fiber = f;
-            thread = thr;
+            thread = (thr == -1 && fiber) ? fiber->getBoundThread() : thr;
         }
 
         ScheduleTask(std::shared_ptr<Fiber>* f, int thr) {
             fiber.swap(*f);
-            thread = thr;
+            thread = (thr == -1 && fiber) ? fiber->getBoundThread() : thr;
         }
 
-        ScheduleTask(std::function<void()> f, int thr) {
-            cb = f;
+        ScheduleTask(Callback f, int thr) {
+            cb = std::move(f);
             thread = thr;
         }
         
-        ScheduleTask(std::function<void()>* f, int thr) {
+        ScheduleTask(Callback* f, int thr) {
             cb.swap(*f);
             thread = thr;
         }
@@ -83,14 +125,48 @@ private:
             fiber = nullptr;
             cb = nullptr;
             thread = -1;
+            inlined = false;
         }
     };
+
+    // 每个工作线程一份
+    struct Worker {
+        // 本线程产生的任务, 允许其它线程窃取
+        WorkStealQueue<ScheduleTask*> local;
+        // 指定在本线程上运行的任务, 只有本线程会取
+        MpmcQueue<ScheduleTask*> mailbox;
+        // start() 创建线程时登记线程 id
+        std::atomic<int> thread = {-1};
+        // 正在运行 idle 协程
+        std::atomic<bool> idle = {false};
+        // 基类 idle() 在这里休眠
+        EventCount parker;
+    };
+
+    // 入队的任务节点从当前线程的空闲节点里取, 取出任务的线程把节点留给自己之后入队时用, 不再每个任务 new/delete
+    static ScheduleTask* NewTask(ScheduleTask&& task);
+    static void FreeTask(ScheduleTask* task);
+
+    void scheduleTask(ScheduleTask&& task);
+    void scheduleTasks(std::vector<ScheduleTask*>& tasks);
+    // 指定了线程的任务投递到对应的信箱, 线程还没登记时返回 false
+    bool postToMailbox(ScheduleTask* task);
+    // 工作线程给自己投递的任务直接放进自己的信箱, 不需要唤醒任何线程
+    bool postToSelf(ScheduleTask* task, int self);
+    // 依次从本线程队列、本线程信箱、全局队列、其它线程队列里取一个任务
+    bool takeTask(ScheduleTask& task, int thread_id, bool& tickle_me);
+    bool stealTask(ScheduleTask& task, int self);
     
 
     std::string name_;
     std::mutex mutex_;
     std::vector<std::shared_ptr<Thread>> threads_;
-    std::vector<ScheduleTask> tasks_;
+    // 全局队列, 无锁, 只放没有指定线程的任务
+    MpmcQueue<ScheduleTask*> tasks_{4096};
+    // 下标为工作线程编号, use_caller 时 0 号属于创建调度器的线程
+    std::vector<std::unique_ptr<Worker>> workers_;
+    // tickle() 从这里开始找休眠的线程, 轮流唤醒
+    std::atomic<size_t> nextTickle_ = {0};
     std::vector<int> threadIds_;
     size_t threadCount_ = 0;
     std::atomic<size_t> activeThreadCount_ = {0};
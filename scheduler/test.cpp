@@ -7,7 +7,14 @@
  * @FilePath: /coroutine-lib/scheduler/test.cpp
  * @mushanyu
  */
+// 断言里有要执行的调用, 总是打开
+#undef NDEBUG
 #include "scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <cassert>
 
 using namespace mushanyu;
 
@@ -22,7 +29,228 @@ void task() {
     sleep(1);
 }
 
+// 等 pred 成立, 最多等 ms 毫秒
+static bool waitFor(const std::function<bool()>& pred, int ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (!pred()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// 取到的值合起来必须正好是 1..n 各一次
+static void checkExactlyOnce(std::vector<std::vector<intptr_t>>& taken, intptr_t n) {
+    std::vector<intptr_t> all;
+    for (auto& v : taken) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    std::sort(all.begin(), all.end());
+    assert((intptr_t)all.size() == n);
+    for (intptr_t i = 0; i < n; i++) {
+        assert(all[i] == i + 1);
+    }
+}
+
+// 所属线程交替单个/批量放入和弹出, 同时几个线程窃取; 初始容量很小, 中途多次扩容
+static void testWorkStealQueue() {
+    const intptr_t kItems = 200000;
+    const int kStealers = 3;
+    WorkStealQueue<intptr_t> queue(4);
+    std::vector<std::vector<intptr_t>> taken(kStealers + 1);
+    std::atomic<bool> done{false};
+
+    std::vector<std::thread> stealers;
+    for (int i = 0; i < kStealers; i++) {
+        stealers.emplace_back([&, i]() {
+            intptr_t item;
+            while (!done || !queue.empty()) {
+                if (queue.steal(item)) {
+                    taken[i].push_back(item);
+                }
+            }
+        });
+    }
+
+    intptr_t next = 1;
+    intptr_t batch[16];
+    while (next <= kItems) {
+        if (next % 7 == 0) {
+            size_t n = std::min<intptr_t>(16, kItems - next + 1);
+            for (size_t i = 0; i < n; i++) {
+                batch[i] = next++;
+            }
+            queue.push(batch, n);
+        } else {
+            queue.push(next++);
+        }
+        intptr_t item;
+        if (next % 3 == 0 && queue.pop(item)) {
+            taken[kStealers].push_back(item);
+        }
+    }
+    intptr_t item;
+    while (queue.pop(item)) {
+        taken[kStealers].push_back(item);
+    }
+    done = true;
+    for (auto& t : stealers) {
+        t.join();
+    }
+    checkExactlyOnce(taken, kItems);
+}
+
+// 环形缓冲区写满后进溢出队列, 取空之后缓冲区照常使用
+static void testMpmcOverflow() {
+    MpmcQueue<intptr_t> queue(4);
+    for (intptr_t i = 1; i <= 6; i++) {
+        queue.push(i);
+    }
+    intptr_t batch[] = {7, 8, 9};
+    queue.push(batch, 3);
+    std::vector<intptr_t> got;
+    intptr_t item;
+    while (queue.pop(item)) {
+        got.push_back(item);
+    }
+    std::sort(got.begin(), got.end());
+    assert(got == std::vector<intptr_t>({1, 2, 3, 4, 5, 6, 7, 8, 9}));
+    assert(queue.empty());
+
+    // 回到无锁部分, 没有溢出时先进先出
+    got.clear();
+    queue.push(batch, 3);
+    queue.push(10);
+    while (queue.pop(item)) {
+        got.push_back(item);
+    }
+    assert(got == std::vector<intptr_t>({7, 8, 9, 10}));
+
+    // 多个生产者和消费者, 容量小到一直在溢出和缓冲区之间切换
+    const int kThreads = 4;
+    const intptr_t kPerThread = 50000;
+    std::vector<std::vector<intptr_t>> taken(kThreads);
+    std::atomic<int> producing{kThreads};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; i++) {
+        threads.emplace_back([&, i]() {
+            for (intptr_t j = 0; j < kPerThread; j++) {
+                queue.push(i * kPerThread + j + 1);
+            }
+            producing--;
+        });
+        threads.emplace_back([&, i]() {
+            intptr_t item;
+            while (producing > 0 || !queue.empty()) {
+                if (queue.pop(item)) {
+                    taken[i].push_back(item);
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    checkExactlyOnce(taken, kThreads * kPerThread);
+}
+
+// 工作线程一次提交一大批回调: 全部执行且只执行一次
+static void testScheduleBatchBurst() {
+    const int kTasks = 10000;
+    Scheduler scheduler(4, false, "batch");
+    scheduler.start();
+    std::vector<std::atomic<int>> runs(kTasks);
+    std::atomic<int> finished{0};
+    scheduler.scheduleLock([&]() {
+        std::vector<Callback> cbs;
+        for (int i = 0; i < kTasks; i++) {
+            cbs.emplace_back([&, i]() {
+                runs[i]++;
+                finished++;
+            });
+        }
+        scheduler.scheduleBatch(cbs.begin(), cbs.end());
+        // 元素已经被移走
+        assert(!cbs[0]);
+    });
+    assert(waitFor([&]() {return finished == kTasks;}, 5000));
+    scheduler.stop();
+    for (auto& r : runs) {
+        assert(r == 1);
+    }
+}
+
+// 每次只放一个令牌再 notify 一次, 等待方在 prepareWait 和 wait 之间错过通知就会一直睡下去, 令牌没人取
+static void testEventCount() {
+    const int kRounds = 20000;
+    const int kWaiters = 4;
+    EventCount ec;
+    std::atomic<int> tokens{0};
+    std::atomic<int> consumed{0};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> waiters;
+    for (int i = 0; i < kWaiters; i++) {
+        waiters.emplace_back([&]() {
+            while (!stop) {
+                int n = tokens.load();
+                if (n > 0) {
+                    if (tokens.compare_exchange_weak(n, n - 1)) {
+                        consumed++;
+                    }
+                    continue;
+                }
+                uint32_t key = ec.prepareWait();
+                if (tokens > 0 || stop) {
+                    ec.cancelWait();
+                    continue;
+                }
+                ec.wait(key);
+            }
+        });
+    }
+    for (int i = 0; i < kRounds; i++) {
+        // 隔一段时间让所有等待方都真正睡下
+        if (i % 1000 == 0) {
+            usleep(1000);
+        }
+        tokens++;
+        ec.notify();
+        assert(waitFor([&]() {return consumed == i + 1;}, 1000));
+    }
+    stop = true;
+    ec.notifyAll();
+    for (auto& t : waiters) {
+        t.join();
+    }
+    assert(!ec.hasWaiters());
+}
+
+// 工作线程反复在空闲时休眠, 每个任务都要及时唤醒一个线程来运行
+static void testParkUnpark() {
+    const int kRounds = 2000;
+    Scheduler scheduler(4, false, "park");
+    scheduler.start();
+    std::atomic<int> ran{0};
+    for (int i = 0; i < kRounds; i++) {
+        if (i % 100 == 0) {
+            usleep(1000);
+        }
+        scheduler.scheduleLock([&]() {ran++;});
+        assert(waitFor([&]() {return ran == i + 1;}, 1000));
+    }
+    scheduler.stop();
+}
+
 int main() {
+    testEventCount();
+    testParkUnpark();
+    testWorkStealQueue();
+    testMpmcOverflow();
+    testScheduleBatchBurst();
+    std::cout << "queues ok" << std::endl;
+
     {
         std::shared_ptr<Scheduler> scheduler = std::make_shared<Scheduler> (3, true, "scheduler_1");
         
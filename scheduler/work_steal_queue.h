@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace mushanyu {
+/***
+ * @description: Chase-Lev 工作窃取双端队列
+ * 只有所属线程可以 push/pop(从底部, 后进先出), 其它线程通过 steal 从顶部取(先进先出).
+ * 环形数组满了翻倍扩容, 旧数组可能还在被窃取方读取, 留到析构时统一释放.
+ * T 需要是能放进 std::atomic 的类型, 一般是指针.
+ */
+template <class T>
+class WorkStealQueue {
+public:
+    // capacity 必须是 2 的幂
+    explicit WorkStealQueue(int64_t capacity = 256) {
+        array_.store(new Array(capacity), std::memory_order_relaxed);
+    }
+
+    ~WorkStealQueue() {
+        for (Array* a : garbage_) {
+            delete a;
+        }
+        delete array_.load(std::memory_order_relaxed);
+    }
+
+    WorkStealQueue(const WorkStealQueue&) = delete;
+    WorkStealQueue& operator=(const WorkStealQueue&) = delete;
+
+    // 仅所属线程调用
+    void push(T item) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Array* a = array_.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            Array* bigger = a->grow(b, t);
+            garbage_.push_back(a);
+            a = bigger;
+            array_.store(a, std::memory_order_release);
+        }
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // 仅所属线程调用, 批量放入, 只发布一次
+    void push(const T* items, size_t n) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Array* a = array_.load(std::memory_order_relaxed);
+        while (b - t + (int64_t)n > a->capacity) {
+            Array* bigger = a->grow(b, t);
+            garbage_.push_back(a);
+            a = bigger;
+            array_.store(a, std::memory_order_release);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            a->put(b + i, items[i]);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + n, std::memory_order_relaxed);
+    }
+
+    // 仅所属线程调用
+    bool pop(T& item) {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Array* a = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        item = a->get(b);
+        if (t == b) {
+            // 只剩最后一个, 和窃取方竞争
+            bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // 任意线程调用
+    bool steal(T& item) {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        Array* a = array_.load(std::memory_order_acquire);
+        item = a->get(t);
+        return top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        return b <= t;
+    }
+
+    size_t size() const {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+private:
+    struct Array {
+        int64_t capacity;
+        int64_t mask;
+        std::atomic<T>* buffer;
+
+        explicit Array(int64_t c) : capacity(c), mask(c - 1), buffer(new std::atomic<T>[c]) {}
+        ~Array() {delete[] buffer;}
+
+        T get(int64_t i) const {return buffer[i & mask].load(std::memory_order_relaxed);}
+        void put(int64_t i, T item) {buffer[i & mask].store(item, std::memory_order_relaxed);}
+
+        Array* grow(int64_t b, int64_t t) const {
+            Array* a = new Array(capacity * 2);
+            for (int64_t i = t; i < b; ++i) {
+                a->put(i, get(i));
+            }
+            return a;
+        }
+    };
+
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    alignas(64) std::atomic<Array*> array_{nullptr};
+    std::vector<Array*> garbage_;
+};
+}
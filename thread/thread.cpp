@@ -1,6 +1,8 @@
 #include "thread.h"
 
 #include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
 #include <iostream>
 #include <unistd.h>
 
@@ -29,6 +31,18 @@ namespace mushanyu {
     }
 
 
+    bool Thread::SetAffinity(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rt) {
+            std::cerr << "pthread_setaffinity_np fail, rt = " << rt << " cpu = " << cpu << std::endl;
+            return false;
+        }
+        return true;
+    }
+
     Thread::Thread(std::function<void()> cb, const std::string& name) :
     m_cb(cb), m_name(name) {
         int rt = pthread_create(&m_thread, nullptr, &Thread::run, this);
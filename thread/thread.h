@@ -55,6 +55,9 @@ public:
     static const std::string& GetName();
 
     static void SetName(const std::string& name);
+
+    // 把当前线程绑定到 cpu 上运行
+    static bool SetAffinity(int cpu);
     
 
 private:
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+
+namespace mushanyu {
+    /***
+     * @description: 定时器使用的单调时钟(CLOCK_MONOTONIC), 不受修改系统时间和 NTP 调整的影响
+     * 调度线程上带缓存: 事件循环在 epoll_wait 返回后 Refresh(), 调度器开始运行每个任务前 Invalidate(),
+     * 任务里第一次 Now() 读时钟并缓存, 之后复用. 因此任务里长时间计算后再取的时间会偏早,
+     * 需要精确时间时自己调用 Refresh(). 其它线程不缓存, 每次 Now() 都读时钟.
+     */
+    class Clock {
+    public:
+        using TimePoint = std::chrono::steady_clock::time_point;
+
+        static TimePoint Now() {
+            if (t_state == CACHED) {
+                return t_now;
+            }
+            TimePoint now = std::chrono::steady_clock::now();
+            if (t_state == LAZY) {
+                t_now = now;
+                t_state = CACHED;
+            }
+            return now;
+        }
+
+        static TimePoint Refresh() {
+            t_now = std::chrono::steady_clock::now();
+            t_state = CACHED;
+            return t_now;
+        }
+
+        static void Invalidate() {
+            t_state = LAZY;
+        }
+
+    private:
+        enum State {
+            // 没有参与调度的线程, 不缓存
+            OFF,
+            // 下一次 Now() 时缓存
+            LAZY,
+            CACHED
+        };
+
+        static inline thread_local State t_state = OFF;
+        static inline thread_local TimePoint t_now;
+    };
+}
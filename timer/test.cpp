@@ -1,15 +1,101 @@
+// 断言里有要执行的调用, 总是打开
+#undef NDEBUG
 #include "timer.h"
 #include <unistd.h>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <cassert>
 using namespace mushanyu;
 
+// 触发过的定时器编号, 按触发顺序
+std::vector<int> fired;
+
 void func(int i) {
     std::cout << "i: " << i << std::endl;
+    fired.push_back(i);
+}
+
+// 取出到期的回调并按顺序执行, 返回个数
+size_t runExpired(TimerManager& manager) {
+    std::vector<Callback> cbs;
+    manager.listExpiredCb(cbs);
+    for (auto& cb : cbs) {
+        cb();
+    }
+    return cbs.size();
+}
+
+std::vector<int> range(int first, int n) {
+    std::vector<int> v;
+    for (int i = 0; i < n; i++) {
+        v.push_back(first + i);
+    }
+    return v;
+}
+
+// 简化的事件循环: 睡到下一个定时器到期, 全局分片的最早到期时间提前时被叫醒
+class Loop : public TimerManager {
+public:
+    void run() {
+        while (!stop_) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!woken_) {
+                cv_.wait_for(lock, std::chrono::microseconds(std::min<uint64_t>(getNextTimerUs(), 5000000)));
+            }
+            woken_ = false;
+            lock.unlock();
+            runExpired(*this);
+        }
+    }
+
+    void stop() {
+        stop_ = true;
+        onTimerInsertedAtFront();
+    }
+
+protected:
+    void onTimerInsertedAtFront() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        woken_ = true;
+        cv_.notify_one();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool woken_ = false;
+    std::atomic<bool> stop_{false};
+};
+
+// 事件循环睡着时别的线程加一个 1ms 定时器, 要叫醒它按时触发, 而不是等到原来的超时
+static void testForeignLatency() {
+    Loop loop;
+    std::thread thread([&]() {loop.run();});
+    for (int i = 0; i < 20; i++) {
+        // 等事件循环睡下
+        usleep(10000);
+        std::atomic<bool> done{false};
+        auto start = std::chrono::steady_clock::now();
+        loop.addTimer(1, [&]() {done = true;});
+        while (!done) {
+            usleep(100);
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        assert(ms < 20);
+    }
+    loop.stop();
+    thread.join();
 }
 
 int main() {
+    testForeignLatency();
+
     std::shared_ptr<TimerManager> manager(new TimerManager());
-    std::vector<std::function<void()>> cbs;
 
     {
         for (int i = 0; i < 10; i++) {
@@ -18,38 +104,87 @@ int main() {
 
         std::cout << "all timers has been set up" << std::endl;
 
+        // 5 秒时第 0 到 4 个到期, 按到期顺序触发
         sleep(5);
+        runExpired(*manager);
+        assert(fired.size() >= 5 && fired.size() < 10);
+        assert(fired == range(0, fired.size()));
 
-        manager->listExpiredCb(cbs);
-        while (!cbs.empty()) {
-            std::function<void()> cb = *cbs.begin();
-            cbs.erase(cbs.begin());
-            cb();
-        }
-        
         sleep(5);
+        runExpired(*manager);
+        assert(fired == range(0, 10));
+        assert(!manager->hasTimer());
+        fired.clear();
+    }
+
+    {
+        // 循环定时器每秒触发一次
+        std::shared_ptr<Timer> timer = manager->addTimer(1000, std::bind(&func, 1000), true);
+        int j = 10;
+        while (j-- > 0) {
+            sleep(1);
+            assert(runExpired(*manager) == 1);
+        }
+        assert(fired == std::vector<int>(10, 1000));
+        assert(timer->cancel());
+        assert(!manager->hasTimer());
+        fired.clear();
+    }
 
-        manager->listExpiredCb(cbs);
-        while (!cbs.empty()) {
-            std::function<void()> cb = *cbs.begin();
-            cbs.erase(cbs.begin());
-            cb();
+    {
+        // 时间轮后端, tick 为 10ms; 取消的不触发
+        std::shared_ptr<TimerManager> wheel(new TimerManager(TimerManager::WHEEL, 10));
+        for (int i = 0; i < 5; i++) {
+            wheel->addTimer((i + 1) * 100, std::bind(&func, 2000 + i), false);
         }
+        assert(wheel->addTimer(300, std::bind(&func, 3000), false)->cancel());
 
+        usleep(550 * 1000);
+
+        assert(runExpired(*wheel) == 5);
+        assert(fired == range(2000, 5));
+        assert(!wheel->hasTimer());
+        fired.clear();
     }
 
     {
-		manager->addTimer(1000, std::bind(&func, 1000), true);
-		int j = 10;
-		while(j-->0)
-		{
-			sleep(1);
-			manager->listExpiredCb(cbs);
-			std::function<void()> cb = *cbs.begin();
-			cbs.erase(cbs.begin());
-			cb();
-			
-		}		
-	}
+        // 侵入式定时器, 取消后不触发, 重新挂上按新的时间触发
+        TimerNode a, b;
+        manager->addTimer(&a, 100, std::bind(&func, 4000));
+        manager->addTimer(&b, 100, std::bind(&func, 4001));
+        assert(b.cancel() && !b.pending());
+        assert(!b.cancel());
+        manager->addTimer(&a, 200, std::bind(&func, 4002));
+
+        // 原来的 100ms 已经作废
+        usleep(150 * 1000);
+        assert(runExpired(*manager) == 0);
+        assert(a.pending() && manager->hasTimer());
+
+        usleep(100 * 1000);
+        assert(runExpired(*manager) == 1);
+        assert(fired == std::vector<int>{4002});
+        assert(!a.pending() && !a.cancel());
+        assert(!manager->hasTimer());
+        fired.clear();
+    }
+
+    {
+        // 默认 slack 20ms, 到期时间相近的定时器合并到同一个桶里, 一次唤醒全部取出
+        std::shared_ptr<TimerManager> coalesced(new TimerManager());
+        coalesced->setTimerSlack(20 * 1000);
+        for (int i = 0; i < 5; i++) {
+            coalesced->addTimer(100 + i * 2, std::bind(&func, 5000 + i), false);
+        }
+        usleep(coalesced->getNextTimerUs());
+
+        // 同一个桶里的先后不确定
+        assert(runExpired(*coalesced) == 5);
+        std::sort(fired.begin(), fired.end());
+        assert(fired == range(5000, 5));
+        fired.clear();
+    }
+
+    std::cout << "timer ok" << std::endl;
     return 0;
-}
\ No newline at end of file
+}
@@ -3,151 +3,448 @@
 
 namespace mushanyu {
     bool Timer::cancel() {
-        std::unique_lock<std::shared_mutex> lock(manager_->mutex_);
-        if (cb_ == nullptr) {
+        std::shared_ptr<Timer> self;
+        TimerShard* shard = nullptr;
+        std::unique_lock<std::mutex> lock = TimerManager::LockShard(shard_, shard);
+        if (!isActive()) {
             return false;
         }
         cb_ = nullptr;
-        auto it = manager_->timers_.find(shared_from_this());
-        if (it != manager_->timers_.end()) {
-            manager_->timers_.erase(it);
-        }
+        recurringCb_.reset();
+        self.swap(wheelRef_);
+        manager_->eraseTimer(shard, this);
+        manager_->updateCount(shard);
         return true;
     }
 
     bool Timer::refresh() {
-        std::unique_lock<std::shared_mutex> lock(manager_->mutex_);
-        if (cb_ == nullptr) {
+        TimerShard* shard = nullptr;
+        std::unique_lock<std::mutex> lock = TimerManager::LockShard(shard_, shard);
+        if (!isActive()) {
             return false;
         }
-        auto it = manager_->timers_.find(shared_from_this());
-        if (it == manager_->timers_.end()) {
+        std::shared_ptr<Timer> self = shared_from_this();
+        if (!manager_->eraseTimer(shard, this)) {
             return false;
         }
-        manager_->timers_.erase(it);
-        next_ = std::chrono::system_clock::now() + std::chrono::milliseconds(ms_);
-        manager_->timers_.insert(shared_from_this());
+        // 只会往后推, 不需要通知事件循环
+        next_ = Clock::Now() + std::chrono::microseconds(us_);
+        manager_->insertTimer(shard, self);
+        manager_->updateCount(shard);
         return true;
     }
 
     bool Timer::reset(uint64_t ms, bool from_now) {
-        if (ms == ms_ && !from_now) {
+        uint64_t us = ms * 1000;
+        if (us == us_ && !from_now) {
             return true;
         }
+        std::shared_ptr<Timer> self = shared_from_this();
         {
-            std::unique_lock<std::shared_mutex> write_lock(manager_->mutex_);
-            if (cb_ == nullptr) {
+            TimerShard* shard = nullptr;
+            std::unique_lock<std::mutex> lock = TimerManager::LockShard(shard_, shard);
+            if (!isActive()) {
                 return false;
             }
-            auto it = manager_->timers_.find(shared_from_this());
-            if (it == manager_->timers_.end()) {
+            if (!manager_->eraseTimer(shard, this)) {
                 return false;
             }
-            manager_->timers_.erase(it);
+            manager_->updateCount(shard);
         }
-        auto start = from_now ? std::chrono::system_clock::now() : next_ - std::chrono::milliseconds(ms_);
-        ms_ = ms;
-        next_ = start + std::chrono::milliseconds(ms_);
-        manager_->addTimer(shared_from_this());
+        auto start = from_now ? Clock::Now() : next_ - std::chrono::microseconds(us_);
+        us_ = us;
+        next_ = start + std::chrono::microseconds(us_);
+        // 重新放进当前线程的分片
+        manager_->addTimer(self);
         return true;
     }
 
-    Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager) : recurring_(recurring), ms_(ms), cb_(cb), manager_(manager) {
-        auto now = std::chrono::system_clock::now();
-        next_ = now + std::chrono::milliseconds(ms_);
+    Timer::Timer(uint64_t us, Callback cb, bool recurring, uint64_t slack_us, TimerManager* manager)
+        : recurring_(recurring), us_(us), slack_(slack_us), manager_(manager) {
+        if (recurring_) {
+            recurringCb_ = std::make_shared<Callback>(std::move(cb));
+        } else {
+            cb_ = std::move(cb);
+        }
+        auto now = Clock::Now();
+        next_ = now + std::chrono::microseconds(us_);
     }
 
+    // 按触发时间排序, 相同的按地址区分, 否则 set 会把它们当成同一个
     bool Timer::Comparator::operator()(const std::shared_ptr<Timer>& lhs, const std::shared_ptr<Timer>& rhs) const {
         assert(lhs != nullptr && rhs != nullptr);
-        return lhs->next_ > rhs->next_;
+        auto l = lhs->fire_;
+        auto r = rhs->fire_;
+        if (l != r) {
+            return l < r;
+        }
+        return lhs.get() < rhs.get();
     }
 
-    TimerManager::TimerManager() {
-        previouseTime_ = std::chrono::system_clock::now();
+    TimerNode::~TimerNode() {
+        TimerManager::Detach(this);
+    }
+
+    bool TimerNode::cancel() {
+        // 交换成功后 manager_ 可能被触发或者摘下的线程同时清空, 先取出来
+        TimerManager* manager = manager_.load(std::memory_order_acquire);
+        if (!manager || !pending_.exchange(false, std::memory_order_acq_rel)) {
+            return false;
+        }
+        manager->liveNodes_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    TimerManager::TimerManager(Backend backend, uint64_t tick_ms) : backend_(backend), tickMs_(tick_ms ? tick_ms : 1) {
+        wheelStart_ = Clock::Now();
+        setTimerShards(0);
     }
 
     TimerManager::~TimerManager() {
+        for (auto& shard : shards_) {
+            std::vector<WheelNode*> nodes;
+            // 轮上的定时器持有自己, 这里断开
+            if (shard->wheel) {
+                shard->wheel->takeAll(nodes);
+                for (WheelNode* node : nodes) {
+                    static_cast<Timer*>(node)->wheelRef_.reset();
+                }
+                nodes.clear();
+            }
+            if (shard->nodeWheel) {
+                shard->nodeWheel->takeAll(nodes);
+                for (WheelNode* node : nodes) {
+                    TimerNode* tn = static_cast<TimerNode*>(node);
+                    tn->pending_.store(false, std::memory_order_relaxed);
+                    tn->shard_.store(nullptr, std::memory_order_relaxed);
+                    tn->manager_.store(nullptr, std::memory_order_relaxed);
+                }
+            }
+        }
     }
 
-    std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
-        std::shared_ptr<Timer> timer(new Timer(ms, cb, recurring, this));
+    void TimerManager::setTimerShards(size_t n) {
+        shards_.clear();
+        for (size_t i = 0; i < n + 1; ++i) {
+            shards_.emplace_back(new TimerShard());
+            if (backend_ == WHEEL) {
+                shards_.back()->wheel.reset(new TimingWheel());
+            }
+        }
+    }
+
+    TimerShard* TimerManager::localShard() {
+        int index = currentTimerShard();
+        if (index >= 0 && (size_t)index + 1 < shards_.size()) {
+            return shards_[index + 1].get();
+        }
+        return shards_[0].get();
+    }
+
+    std::unique_lock<std::mutex> TimerManager::LockShard(std::atomic<TimerShard*>& ref, TimerShard*& shard) {
+        while (true) {
+            shard = ref.load(std::memory_order_acquire);
+            if (!shard) {
+                return std::unique_lock<std::mutex>();
+            }
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            // 加锁期间定时器可能被挪到了别的分片
+            if (ref.load(std::memory_order_relaxed) == shard) {
+                return lock;
+            }
+        }
+    }
+
+    std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, Callback cb, bool recurring) {
+        return addTimerUs(ms * 1000, std::move(cb), recurring, getTimerSlack());
+    }
+
+    std::shared_ptr<Timer> TimerManager::addTimerUs(uint64_t us, Callback cb, bool recurring, uint64_t slack_us) {
+        std::shared_ptr<Timer> timer(new Timer(us, std::move(cb), recurring, slack_us, this));
         addTimer(timer);
         return timer;
     }
 
-    static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
-        std::shared_ptr<void> tmp = weak_cond.lock();
-        if (tmp) {
-            cb();
+    void TimerManager::addTimer(TimerNode* node, uint64_t ms, Callback cb) {
+        TimerShard* shard = localShard();
+        // 挂在别的分片(包括别的管理器的分片)上时先摘下; 不在轮上的节点 shard_ 为空, 不会碰到已经析构的管理器
+        if (node->shard_.load(std::memory_order_acquire) != shard) {
+            Detach(node);
+        }
+        bool at_front = false;
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            if (!shard->nodeWheel) {
+                shard->nodeWheel.reset(new TimingWheel());
+            }
+            if (node->linked()) {
+                shard->nodeWheel->remove(node);
+            }
+            // cancel() 看到等待标记时要能看到 manager_
+            node->manager_.store(this, std::memory_order_release);
+            node->shard_.store(shard, std::memory_order_release);
+            if (!node->pending_.exchange(true, std::memory_order_acq_rel)) {
+                liveNodes_.fetch_add(1, std::memory_order_relaxed);
+            }
+            node->cb_ = std::move(cb);
+            node->expire = toTick(coalesce(Clock::Now() + std::chrono::milliseconds(ms), getTimerSlack()));
+            uint64_t before = shard->nodeWheel->nextExpire();
+            shard->nodeWheel->add(node);
+            updateCount(shard);
+            at_front = shard == shards_[0].get() && node->expire < before && !shard->tickled;
+            if (at_front) {
+                shard->tickled = true;
+            }
+        }
+        if (at_front) {
+            onTimerInsertedAtFront();
         }
     }
 
-    std::shared_ptr<Timer> TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring) {
-        return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+    void TimerManager::Detach(TimerNode* node) {
+        TimerShard* shard = nullptr;
+        std::unique_lock<std::mutex> lock = LockShard(node->shard_, shard);
+        if (!shard) {
+            return;
+        }
+        // 持有分片锁时节点还在这个分片上, 分片和它的管理器都还活着
+        TimerManager* manager = node->manager_.load(std::memory_order_relaxed);
+        if (node->linked()) {
+            shard->nodeWheel->remove(node);
+            manager->updateCount(shard);
+        }
+        if (node->pending_.exchange(false, std::memory_order_acq_rel)) {
+            manager->liveNodes_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        node->manager_.store(nullptr, std::memory_order_relaxed);
+        node->shard_.store(nullptr, std::memory_order_relaxed);
     }
 
-    uint64_t TimerManager::getNextTimer() {
-        std::shared_lock<std::shared_mutex> read_lock(mutex_);
+    std::shared_ptr<Timer> TimerManager::addConditionTimer(uint64_t ms, Callback cb, std::weak_ptr<void> weak_cond, bool recurring) {
+        std::shared_ptr<Timer> timer(new Timer(ms * 1000, std::move(cb), recurring, getTimerSlack(), this));
+        timer->cond_ = weak_cond;
+        timer->hasCond_ = true;
+        addTimer(timer);
+        return timer;
+    }
+
+    uint64_t TimerManager::toTick(Clock::TimePoint time) const {
+        if (time <= wheelStart_) {
+            return 0;
+        }
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time - wheelStart_).count();
+        // 向上取整, 保证不会提前触发
+        uint64_t tick_ns = tickMs_ * 1000000;
+        return (ns + tick_ns - 1) / tick_ns;
+    }
+
+    Clock::TimePoint TimerManager::coalesce(Clock::TimePoint time, uint64_t slack_us) const {
+        if (slack_us == 0 || time <= wheelStart_) {
+            return time;
+        }
+        // 桶宽取不超过 slack 的最大的 2 的幂, 向下对齐到桶边界后仍然晚于 time
+        uint64_t bucket = 1ull << (63 - __builtin_clzll(slack_us));
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(time - wheelStart_).count();
+        return wheelStart_ + std::chrono::microseconds((us + slack_us) / bucket * bucket);
+    }
+
+    bool TimerManager::insertTimer(TimerShard* shard, const std::shared_ptr<Timer>& timer) {
+        timer->fire_ = coalesce(timer->next_, timer->slack_);
+        if (backend_ == TREE) {
+            // 先插入再取 begin(), 两者放在同一个表达式里求值顺序不确定
+            auto it = shard->timers.insert(timer).first;
+            return it == shard->timers.begin();
+        }
+        uint64_t before = shard->wheel->nextExpire();
+        timer->expire = toTick(timer->fire_);
+        timer->wheelRef_ = timer;
+        shard->wheel->add(timer.get());
+        return timer->expire < before;
+    }
+
+    bool TimerManager::eraseTimer(TimerShard* shard, Timer* timer) {
+        if (backend_ == TREE) {
+            auto it = shard->timers.find(timer->shared_from_this());
+            if (it == shard->timers.end()) {
+                return false;
+            }
+            shard->timers.erase(it);
+            return true;
+        }
+        if (!timer->linked()) {
+            return false;
+        }
+        shard->wheel->remove(timer);
+        // 调用方都还持有 shared_ptr, 这里断开不会析构
+        timer->wheelRef_.reset();
+        return true;
+    }
 
-        tickled_ = false;
+    void TimerManager::updateCount(TimerShard* shard) {
+        size_t n = backend_ == TREE ? shard->timers.size() : shard->wheel->size();
+        if (shard->nodeWheel) {
+            n += shard->nodeWheel->size();
+        }
+        shard->count.store(n, std::memory_order_release);
+    }
 
-        if (timers_.empty()) {
+    Clock::TimePoint TimerManager::nextExpire(TimerShard* shard) {
+        Clock::TimePoint time = Clock::TimePoint::max();
+        if (backend_ == TREE) {
+            if (!shard->timers.empty()) {
+                time = (*shard->timers.begin())->fire_;
+            }
+        } else {
+            uint64_t tick = shard->wheel->nextExpire();
+            if (tick != UINT64_MAX) {
+                time = wheelStart_ + std::chrono::milliseconds(tick * tickMs_);
+            }
+        }
+        if (shard->nodeWheel) {
+            uint64_t tick = shard->nodeWheel->nextExpire();
+            if (tick != UINT64_MAX) {
+                time = std::min(time, wheelStart_ + std::chrono::milliseconds(tick * tickMs_));
+            }
+        }
+        return time;
+    }
+
+    uint64_t TimerManager::getNextTimer() {
+        uint64_t us = getNextTimerUs();
+        return us == ~0ull ? us : (us + 999) / 1000;
+    }
+
+    uint64_t TimerManager::getNextTimerUs() {
+        Clock::TimePoint time = Clock::TimePoint::max();
+        TimerShard* local = localShard();
+        for (TimerShard* shard : {shards_[0].get(), local}) {
+            // 空分片不加锁, 之后插入的定时器会自己通知
+            if (shard->count.load(std::memory_order_acquire) == 0) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->tickled = false;
+            time = std::min(time, nextExpire(shard));
+            if (local == shards_[0].get()) {
+                break;
+            }
+        }
+        if (time == Clock::TimePoint::max()) {
             return ~0ull;
         }
-        auto now = std::chrono::system_clock::now();
-        auto time = (*timers_.begin())->next_;
+        auto now = Clock::Now();
         if (now >= time) {
             return 0;
         }
 
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(time - now);
-        return static_cast<uint64_t>(duration.count());
+        // 向上取整, 不要在到期前醒来
+        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(time - now);
+        return static_cast<uint64_t>((duration.count() + 999) / 1000);
+    }
+
+    void TimerManager::listExpiredCb(std::vector<Callback>& cbs) {
+        auto now = Clock::Now();
+        TimerShard* local = localShard();
+        for (TimerShard* shard : {shards_[0].get(), local}) {
+            if (shard->count.load(std::memory_order_acquire) != 0) {
+                collectExpired(shard, now, cbs);
+            }
+            if (local == shards_[0].get()) {
+                break;
+            }
+        }
     }
 
-    void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs) {
-        auto now = std::chrono::system_clock::now();
-        std::unique_lock<std::shared_mutex> write_lock(mutex_);
-        bool rollover = detectClockRollover();
-        while (!timers_.empty() && rollover || !timers_.empty() && now >= (*timers_.begin())->next_) {
-            std::shared_ptr<Timer> tmp = *timers_.begin();
-            timers_.erase(timers_.begin());
-            cbs.push_back(tmp->cb_);
+    void TimerManager::collectExpired(TimerShard* shard, Clock::TimePoint now, std::vector<Callback>& cbs) {
+        std::vector<std::shared_ptr<Timer>> expired;
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        if (backend_ == TREE) {
+            // 按触发时间的顺序, 已经过了最早触发时间的都顺带触发
+            while (!shard->timers.empty() && now >= (*shard->timers.begin())->next_) {
+                expired.push_back(*shard->timers.begin());
+                shard->timers.erase(shard->timers.begin());
+            }
+        }
+        std::vector<WheelNode*> nodes;
+        uint64_t ms = now > wheelStart_ ? std::chrono::duration_cast<std::chrono::milliseconds>(now - wheelStart_).count() : 0;
+        if (backend_ == WHEEL) {
+            shard->wheel->advance(ms / tickMs_, nodes);
+            for (WheelNode* node : nodes) {
+                Timer* timer = static_cast<Timer*>(node);
+                expired.emplace_back(std::move(timer->wheelRef_));
+            }
+            nodes.clear();
+        }
+        if (shard->nodeWheel) {
+            shard->nodeWheel->advance(ms / tickMs_, nodes);
+            // 已经取消的直接跳过; 摘下的节点不再指向本管理器
+            for (WheelNode* node : nodes) {
+                TimerNode* tn = static_cast<TimerNode*>(node);
+                if (tn->pending_.exchange(false, std::memory_order_acq_rel)) {
+                    liveNodes_.fetch_sub(1, std::memory_order_relaxed);
+                    cbs.push_back(std::move(tn->cb_));
+                } else {
+                    tn->cb_ = nullptr;
+                }
+                tn->manager_.store(nullptr, std::memory_order_relaxed);
+                tn->shard_.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+        for (auto& tmp : expired) {
+            // reset() 在两个分片之间挪动时被取消的
+            if (!tmp->isActive()) {
+                continue;
+            }
+            if (tmp->hasCond_ && tmp->cond_.expired()) {
+                tmp->cb_ = nullptr;
+                tmp->recurringCb_.reset();
+                continue;
+            }
             if (tmp->recurring_) {
-                tmp->next_ = now + std::chrono::milliseconds(tmp->ms_);
-                timers_.insert(tmp);
+                cbs.emplace_back([cb = tmp->recurringCb_]() {
+                    (*cb)();
+                });
+                tmp->next_ = now + std::chrono::microseconds(tmp->us_);
+                insertTimer(shard, tmp);
             } else {
-                tmp->cb_ = nullptr;
+                cbs.push_back(std::move(tmp->cb_));
             }
         }
+        updateCount(shard);
     }
 
     bool TimerManager::hasTimer() {
-        std::shared_lock<std::shared_mutex> read_lock(mutex_);
-        return !timers_.empty();
+        if (liveNodes_.load(std::memory_order_relaxed) > 0) {
+            return true;
+        }
+        for (auto& shard : shards_) {
+            if (shard->count.load(std::memory_order_acquire) == 0) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            size_t n = backend_ == TREE ? shard->timers.size() : shard->wheel->size();
+            if (n > 0) {
+                return true;
+            }
+        }
+        return false;
     }
 
     void TimerManager::addTimer(std::shared_ptr<Timer> timer) {
+        TimerShard* shard = localShard();
         bool at_front = false;
         {
-            std::unique_lock<std::shared_mutex> write_lock(mutex_);
-            auto it = timers_.insert(timer).first;
-            at_front = (it == timers_.begin() && !tickled_);
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            timer->shard_.store(shard, std::memory_order_release);
+            at_front = insertTimer(shard, timer) && shard == shards_[0].get() && !shard->tickled;
+            updateCount(shard);
             if (at_front) {
-                tickled_ = true;
+                shard->tickled = true;
             }
         }
+        // 私有分片的主人正在运行, 回到事件循环时会重新取超时时间, 不需要通知
         if (at_front) {
             onTimerInsertedAtFront();
         }
     }
-
-    bool TimerManager::detectClockRollover() {
-        bool rollover = false;
-        auto now = std::chrono::system_clock::now();
-        if (now < (previouseTime_ - std::chrono::seconds(60 * 60 * 1000))) {
-            rollover = true;
-        }
-        previouseTime_ = now;
-        return rollover;
-    }
 } 
@@ -6,61 +6,192 @@
 #include <set>
 #include <functional>
 #include <shared_mutex>
+#include <chrono>
+#include <atomic>
+
+#include "../callback/callback.h"
+#include "timing_wheel.h"
+#include "clock.h"
 
 namespace mushanyu {
 
     class TimerManager;
+    struct TimerShard;
 
-    class Timer : public std::enable_shared_from_this<Timer>{
+    // 时间轮后端下定时器直接作为链表节点挂在轮上
+    class Timer : public std::enable_shared_from_this<Timer>, private WheelNode {
         friend class TimerManager;
+        friend struct TimerShard;
     public:
         bool cancel();
         bool refresh();
         bool reset(uint64_t ms, bool from_now);
 
+        // 允许晚触发的时间(微秒)
+        uint64_t getSlack() const {return slack_;}
+
     private:
-        Timer(u_int64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
+        Timer(uint64_t us, Callback cb, bool recurring, uint64_t slack_us, TimerManager* manager);
+        // 定时器还没被取消, 也没有一次性地触发过
+        bool isActive() const {return cb_ || recurringCb_;}
+
         bool recurring_ = false;
-        uint64_t ms_ = 0;
+        // 周期, 微秒
+        uint64_t us_ = 0;
+        uint64_t slack_ = 0;
         TimerManager* manager_ = nullptr;
-        std::function<void()> cb_;
-        std::chrono::time_point<std::chrono::system_clock> next_;
+        // 所在的分片, 只在持有分片锁时修改
+        std::atomic<TimerShard*> shard_ = {nullptr};
+        // 一次性定时器的回调, 触发时移交给调用方
+        Callback cb_;
+        // 循环定时器的回调, 每次触发交出去一个共享它的包装
+        std::shared_ptr<Callback> recurringCb_;
+        // 条件定时器: 到期时条件对象已经释放则不触发
+        std::weak_ptr<void> cond_;
+        bool hasCond_ = false;
+        // 最早触发时间
+        Clock::TimePoint next_;
+        // 实际安排的触发时间, 在 [next_, next_ + slack_] 内, 插入时计算
+        Clock::TimePoint fire_;
+        // 挂在时间轮上时持有自己, 保证轮上的裸指针有效
+        std::shared_ptr<Timer> wheelRef_;
 
         struct Comparator {
             bool operator()(const std::shared_ptr<Timer>& lhs, const std::shared_ptr<Timer>& rhs) const;
         };
     };
 
+    /***
+     * @description: 侵入式定时器, 由调用方嵌入到自己的对象里(比如每个连接一个), 挂上和触发都不做堆分配
+     * cancel() 只清掉等待标记, 不加锁也不摘链表, 到期时直接跳过; 重新挂上或者析构时才在锁内摘下.
+     * 已经到期交出去的回调在 cancel() 之后仍可能执行, 回调里要自己判断是否还有效.
+     */
+    class TimerNode : private WheelNode {
+        friend class TimerManager;
+    public:
+        TimerNode() = default;
+        ~TimerNode();
+
+        TimerNode(const TimerNode&) = delete;
+        TimerNode& operator=(const TimerNode&) = delete;
+
+        // 返回是否取消了一个还在等待的定时器
+        bool cancel();
+        bool pending() const {return pending_.load(std::memory_order_acquire);}
+
+    private:
+        // 挂在轮上时指向所属的管理器和分片, 摘下或者触发时一起清空, 只在持有分片锁时修改
+        std::atomic<TimerManager*> manager_ = {nullptr};
+        std::atomic<TimerShard*> shard_ = {nullptr};
+        std::atomic<bool> pending_ = {false};
+        Callback cb_;
+    };
+
+    // 一个分片的定时器, 由 mutex 保护
+    struct TimerShard {
+        std::mutex mutex;
+        std::set<std::shared_ptr<Timer>, Timer::Comparator> timers;
+        std::unique_ptr<TimingWheel> wheel;
+        // 侵入式定时器总是放在时间轮上, 第一次用到时创建
+        std::unique_ptr<TimingWheel> nodeWheel;
+        // 最早到期时间变了并且已经通知过事件循环, 事件循环重新取超时时间前不再通知
+        bool tickled = false;
+        // 挂着的定时器数(包括已取消还没摘下的侵入式定时器), 为 0 时不加锁直接跳过
+        std::atomic<size_t> count = {0};
+    };
+
+    /***
+     * @description: 定时器按分片管理, 每个分片一把锁. 默认只有一个全局分片;
+     * 子类通过 setTimerShards() 和 currentTimerShard() 给每个工作线程一个私有分片:
+     * 工作线程上添加的定时器放进自己的分片并由自己触发, 其它线程添加的放进全局分片, 由任意工作线程触发.
+     * 只有跨线程取消或者修改定时器时才会碰到别的线程的分片锁.
+     */
     class TimerManager {
         friend class Timer;
+        friend class TimerNode;
     public:
-        TimerManager();
+        // TREE: 按触发时间排序的红黑树, 精确到微秒
+        // WHEEL: 分层时间轮, 插入和取消 O(1), 触发时间按 tick 向上取整
+        // 两种后端都支持 slack: 定时器在 [到期时间, 到期时间 + slack] 内触发, 触发时间对齐到桶的边界,
+        // 窗口重叠的定时器落在同一个边界上, 由一次唤醒一起处理
+        enum Backend {
+            TREE,
+            WHEEL
+        };
+
+        TimerManager(Backend backend = TREE, uint64_t tick_ms = 1);
         virtual ~TimerManager();
 
-        std::shared_ptr<Timer> addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+        // 使用 setTimerSlack() 设置的默认 slack
+        std::shared_ptr<Timer> addTimer(uint64_t ms, Callback cb, bool recurring = false);
+
+        // 微秒精度, slack_us 为允许晚触发的时间, 不使用默认 slack
+        std::shared_ptr<Timer> addTimerUs(uint64_t us, Callback cb, bool recurring = false, uint64_t slack_us = 0);
         
-        std::shared_ptr<Timer> addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false);
+        // 侵入式定时器, ms 后触发 cb, 使用默认 slack; node 还挂着(包括取消后还没摘下)时先摘下再按新的时间挂上
+        void addTimer(TimerNode* node, uint64_t ms, Callback cb);
+
+        // 条件在到期时检查, 条件对象已经释放的定时器直接丢弃; 使用默认 slack
+        std::shared_ptr<Timer> addConditionTimer(uint64_t ms, Callback cb, std::weak_ptr<void> weak_cond, bool recurring = false);
+
+        // 毫秒接口和侵入式定时器的默认 slack(微秒), 默认 0 即精确触发;
+        // 大量相同超时的连接(比如 SO_RCVTIMEO)设置几毫秒的 slack 可以把唤醒合并成每个桶一次
+        void setTimerSlack(uint64_t us) {slackUs_.store(us, std::memory_order_relaxed);}
+        uint64_t getTimerSlack() const {return slackUs_.load(std::memory_order_relaxed);}
 
+        // 以下三个只看当前线程负责的分片: 全局分片和自己的私有分片
+        // 距离下一次需要处理定时器的毫秒数(向上取整), 没有定时器返回 ~0ull
         uint64_t getNextTimer();
+        // 同上, 微秒
+        uint64_t getNextTimerUs();
         
-        void listExpiredCb(std::vector<std::function<void()>>& cbs);
+        void listExpiredCb(std::vector<Callback>& cbs);
 
+        // 所有分片
         bool hasTimer();
 
     protected:
-        void onTimerInsertedAtFront();
+        // 全局分片上的最早到期时间提前了, 需要叫醒一个事件循环
+        virtual void onTimerInsertedAtFront() {}
 
-        void addTimer(std::shared_ptr<Timer> timer);
-
-    private:
-        bool detectClockRollover();
+        // 当前线程的私有分片编号, 没有返回 -1
+        virtual int currentTimerShard() {return -1;}
 
-        std::shared_mutex mutex_;
+        // 除全局分片外再建 n 个私有分片, 只能在添加定时器之前调用
+        void setTimerShards(size_t n);
 
-        std::set<std::shared_ptr<Timer>, Timer::Comparator> timers_;
-
-        bool tickled_ = false;
+        void addTimer(std::shared_ptr<Timer> timer);
 
-        std::chrono::time_point<std::chrono::system_clock> previouseTime_;
+    private:
+        TimerShard* localShard();
+        // 锁住 ref 当前指向的分片, 锁住后 ref 不会再变; ref 为空时 shard 置空, 返回不持有锁的 unique_lock
+        static std::unique_lock<std::mutex> LockShard(std::atomic<TimerShard*>& ref, TimerShard*& shard);
+
+        // 以下都要求已经持有 shard 的锁
+        // 返回新定时器是否成了最早到期的
+        bool insertTimer(TimerShard* shard, const std::shared_ptr<Timer>& timer);
+        bool eraseTimer(TimerShard* shard, Timer* timer);
+        void updateCount(TimerShard* shard);
+        Clock::TimePoint nextExpire(TimerShard* shard);
+        void collectExpired(TimerShard* shard, Clock::TimePoint now, std::vector<Callback>& cbs);
+
+        uint64_t toTick(Clock::TimePoint time) const;
+        // time 之后 slack_us 之内的桶边界
+        Clock::TimePoint coalesce(Clock::TimePoint time, uint64_t slack_us) const;
+        // 把 node 从所在分片上摘下, 会加锁; 只看 node 的 shard_, 不经过可能已经析构的管理器
+        static void Detach(TimerNode* node);
+
+        Backend backend_;
+        uint64_t tickMs_;
+        // tick 0 对应的时间
+        Clock::TimePoint wheelStart_;
+
+        // shards_[0] 是全局分片, shards_[i + 1] 是第 i 个私有分片
+        std::vector<std::unique_ptr<TimerShard>> shards_;
+
+        std::atomic<uint64_t> slackUs_ = {0};
+
+        // 还在等待(没有取消也没有触发)的侵入式定时器数
+        std::atomic<size_t> liveNodes_ = {0};
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,164 @@
+#include "timing_wheel.h"
+
+namespace mushanyu {
+    static const int kWords = TimingWheel::kSlots / 64;
+
+    TimingWheel::TimingWheel() {
+        for (int l = 0; l < kLevels; ++l) {
+            for (int s = 0; s < kSlots; ++s) {
+                slots_[l][s].prev = slots_[l][s].next = &slots_[l][s];
+            }
+        }
+    }
+
+    void TimingWheel::link(int level, int slot, WheelNode* node) {
+        WheelNode* head = &slots_[level][slot];
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+        node->slot = level * kSlots + slot;
+        bitmap_[level][slot >> 6] |= 1ull << (slot & 63);
+    }
+
+    void TimingWheel::place(WheelNode* node) {
+        uint64_t expire = node->expire < current_ ? current_ : node->expire;
+        uint64_t delta = expire - current_;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (1ull << (kSlotBits * (level + 1)))) {
+            ++level;
+        }
+        // 超出整个轮的范围, 先放在最高层能放的最远位置, 降级时按真实到期时间重新放置
+        uint64_t range = 1ull << (kSlotBits * kLevels);
+        if (delta >= range) {
+            expire = current_ + range - 1;
+        }
+        link(level, (expire >> (kSlotBits * level)) & (kSlots - 1), node);
+    }
+
+    void TimingWheel::add(WheelNode* node) {
+        place(node);
+        ++size_;
+    }
+
+    void TimingWheel::remove(WheelNode* node) {
+        if (!node->linked()) {
+            return;
+        }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        int level = node->slot / kSlots;
+        int slot = node->slot % kSlots;
+        WheelNode* head = &slots_[level][slot];
+        if (head->next == head) {
+            bitmap_[level][slot >> 6] &= ~(1ull << (slot & 63));
+        }
+        node->prev = node->next = nullptr;
+        node->slot = -1;
+        --size_;
+    }
+
+    void TimingWheel::cascade(int level, int slot) {
+        WheelNode* head = &slots_[level][slot];
+        if (head->next == head) {
+            return;
+        }
+        // 先整条摘下来, 过远的节点可能被放回同一个槽
+        WheelNode* first = head->next;
+        head->prev->next = nullptr;
+        head->prev = head->next = head;
+        bitmap_[level][slot >> 6] &= ~(1ull << (slot & 63));
+        while (first) {
+            WheelNode* node = first;
+            first = first->next;
+            place(node);
+        }
+    }
+
+    void TimingWheel::advance(uint64_t now, std::vector<WheelNode*>& expired) {
+        while (current_ <= now) {
+            uint64_t next = nextExpire();
+            if (next > now) {
+                current_ = now + 1;
+                return;
+            }
+            if (next > current_) {
+                current_ = next;
+            }
+            int idx = current_ & (kSlots - 1);
+            if (idx == 0) {
+                for (int l = 1; l < kLevels; ++l) {
+                    int slot = (current_ >> (kSlotBits * l)) & (kSlots - 1);
+                    cascade(l, slot);
+                    if (slot != 0) {
+                        break;
+                    }
+                }
+            }
+            WheelNode* head = &slots_[0][idx];
+            while (head->next != head) {
+                WheelNode* node = head->next;
+                remove(node);
+                expired.push_back(node);
+            }
+            ++current_;
+        }
+    }
+
+    void TimingWheel::takeAll(std::vector<WheelNode*>& out) {
+        for (int l = 0; l < kLevels; ++l) {
+            for (int s = 0; s < kSlots; ++s) {
+                WheelNode* head = &slots_[l][s];
+                while (head->next != head) {
+                    WheelNode* node = head->next;
+                    remove(node);
+                    out.push_back(node);
+                }
+            }
+        }
+    }
+
+    int TimingWheel::findSlot(int level, int from) const {
+        // 最多看 kWords + 1 个字, 最后一个是绕回来的起始字里 from 之前的部分
+        for (int i = 0; i <= kWords; ++i) {
+            int word = ((from >> 6) + i) % kWords;
+            uint64_t bits = bitmap_[level][word];
+            if (i == 0) {
+                bits &= ~0ull << (from & 63);
+            } else if (i == kWords) {
+                bits &= ~(~0ull << (from & 63));
+            }
+            if (bits) {
+                int slot = word * 64 + __builtin_ctzll(bits);
+                return (slot - from + kSlots) % kSlots;
+            }
+        }
+        return -1;
+    }
+
+    uint64_t TimingWheel::nextExpire() const {
+        if (size_ == 0) {
+            return UINT64_MAX;
+        }
+        uint64_t next = UINT64_MAX;
+        int d = findSlot(0, current_ & (kSlots - 1));
+        if (d >= 0) {
+            next = current_ + d;
+        }
+        for (int l = 1; l < kLevels; ++l) {
+            int shift = kSlotBits * l;
+            uint64_t base = current_ >> shift;
+            // 对齐时当前槽还没降级; 不对齐时当前槽已经降级过, 里面的节点要等绕一圈
+            bool aligned = (current_ & ((1ull << shift) - 1)) == 0;
+            int from = aligned ? (base & (kSlots - 1)) : ((base + 1) & (kSlots - 1));
+            d = findSlot(l, from);
+            if (d >= 0) {
+                uint64_t tick = (base + d + (aligned ? 0 : 1)) << shift;
+                if (tick < next) {
+                    next = tick;
+                }
+            }
+        }
+        return next;
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace mushanyu {
+    // 时间轮上的侵入式链表节点, 由使用方嵌入并负责生命周期
+    struct WheelNode {
+        WheelNode* prev = nullptr;
+        WheelNode* next = nullptr;
+        // 到期的 tick
+        uint64_t expire = 0;
+        // 所在的槽, level * kSlots + slot
+        int slot = -1;
+
+        bool linked() const {return prev != nullptr;}
+    };
+
+    /***
+     * @description: 分层时间轮, 4 层每层 256 个槽, 覆盖 2^32 个 tick, 更远的节点先放在最高层, 到时再重新放置
+     * 插入和删除都是 O(1); 推进时按占用位图直接跳到下一个有节点或需要降级的 tick, 不逐个 tick 空转.
+     * 不加锁, 由调用方保证互斥.
+     */
+    class TimingWheel {
+    public:
+        static const int kLevels = 4;
+        static const int kSlotBits = 8;
+        static const int kSlots = 1 << kSlotBits;
+
+        TimingWheel();
+
+        TimingWheel(const TimingWheel&) = delete;
+        TimingWheel& operator=(const TimingWheel&) = delete;
+
+        // node->expire 由调用方设置, 已经过期的节点在下一次 advance 时取出
+        void add(WheelNode* node);
+        void remove(WheelNode* node);
+
+        // 推进到 now (含), 到期节点按到期先后追加到 expired
+        void advance(uint64_t now, std::vector<WheelNode*>& expired);
+
+        // 取出全部节点
+        void takeAll(std::vector<WheelNode*>& out);
+
+        // 下一次需要 advance 的 tick 的下界: 最近的到期时间或者高层槽位的降级时间, 为空时返回 UINT64_MAX
+        uint64_t nextExpire() const;
+
+        size_t size() const {return size_;}
+        bool empty() const {return size_ == 0;}
+        // 小于它的 tick 都已处理过
+        uint64_t current() const {return current_;}
+
+    private:
+        void link(int level, int slot, WheelNode* node);
+        void place(WheelNode* node);
+        // 把 level 层第 slot 个槽里的节点重新放置到更低的层
+        void cascade(int level, int slot);
+        // 从 from 开始(环绕)找 level 层第一个非空槽, 返回距离, 没有返回 -1
+        int findSlot(int level, int from) const;
+
+        // 每个槽是带哨兵的双向循环链表
+        WheelNode slots_[kLevels][kSlots];
+        uint64_t bitmap_[kLevels][kSlots / 64] = {};
+        uint64_t current_ = 0;
+        size_t size_ = 0;
+    };
+}